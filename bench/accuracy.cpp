@@ -0,0 +1,1296 @@
+#include <bench.hpp>
+#include <utility.hpp>
+#include <output.hpp>
+#include <chirp.hpp>
+#include <cpufft.hpp>
+#include <aperture.hpp>
+#include <outofcore.hpp>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <complex>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+/* Accuracy check of the FFT kernels. Each input is transformed on the device
+ * and by a plain separable DFT in double precision (which shares no code with
+ * the FFT), and the largest and RMS errors of the spectrum are reported with
+ * the largest error of the Fraunhofer image (which checks the normalization,
+ * fftshift and orientation of cl_fft_col). Errors are relative to the peak
+ * of the reference. The rectangle and circle inputs are also compared with
+ * their closed forms (a product of Dirichlet kernels, which the DFT matches
+ * exactly, and the Airy pattern, which it only matches up to the staircase
+ * edge of the pixelated circle), to make sure the reference itself is sound.
+ * Non-square sizes are included to catch any mixup between the two axes.
+ * Both the Cooley-Tukey and the Stockham FFT are checked, and so is their
+ * double precision build (DOUBLE_FFT) on devices with cl_khr_fp64, to a much
+ * tighter tolerance: its error is that of double rounding, except in the
+ * image, which is still float.
+ *
+ * So is their pruned form (see fft.cl), on shapes away from the center so
+ * that the windows start at nonzero offsets. The wider ones need one more
+ * stage in the Stockham window (which can only skip an odd number of them)
+ * and push it against the end of the axis, and a batch of tiles, each
+ * shifted by a pixel, checks that every tile transforms its window rows.
+ * A window offset changes the phase of the spectrum, so only its power is
+ * compared with the reference (relative to the squared peak).
+ *
+ * Both algorithms are also built with FRESNEL, and the same inputs checked
+ * against the DFT of the aperture times the chirp exp(i pi p^2 r^2 / (lambda
+ * z)), that is exp(i FRESNEL r^2) with r in pixels from the center. The
+ * chirp is computed in float on the device, where its phase reaches hundreds
+ * of radians at the edge of the largest input, so the rate is kept small.
+ *
+ * The out-of-core FFT (see outofcore.hpp) is given a block budget of a few
+ * rows or columns, and its image decimated by 2 or 4, which it must match to
+ * the in-core image averaged over the same squares (so that the blocks, the
+ * column offsets, the fftshift and the decimation are all exercised).
+ *
+ * The chirp-z transform (see chirp.cl) is checked on the image of each band,
+ * against a direct DFT at its frequencies, s (k - n/2) / n along each axis,
+ * which are cleared past the Nyquist limit. It is pruned to the bounds of
+ * an off-center circle, and its error is relative to the brightest pixel.
+ *
+ * The pupils of cl_pupil are checked on an aberrated circle, each band of
+ * which is compared with the DFT of the complex field the host computes from
+ * the Cartesian form of the Zernike terms (rather than the polar one of
+ * zernike in aperture.cl). Without aberrations, the image of every band must
+ * be identical to that of the plain aperture.
+ *
+ * The CPU backend (see cpufft.hpp) is checked on the random input, with
+ * every instruction set the CPU supports and with the columns transformed
+ * both in place and in six steps. The smallest size is narrower than the
+ * wider vectors, so it checks the fallback to the scalar build.
+ *
+ * The wedge of cl_lens_wedge, filled in by cl_replicate, is checked on an
+ * antialiased hexagon (order 6) against the full render of cl_lens. Both
+ * are noisy and the rotations are interpolated, so they are compared over
+ * squares of WEDGE_BLOCK^2 pixels (down to WEDGE_FLOOR of the brightest),
+ * whose mean relative difference must be within WEDGE_TOLERANCE times that
+ * between two full renders with different seeds; every pixel must also hold
+ * every sample, which a gap in the wedge would not.
+ *
+ * Half storage is checked separately, on the final output: the circle is
+ * rendered from the same samples in float and in half storage (see cl_lens),
+ * and both are encoded as RGBE. The error of each half pixel is relative to
+ * the brightest channel of the float one, in which one step of RGBE is at
+ * most 1/128, so that is the tolerance. */
+
+typedef std::complex<double> complex;
+
+/* The Fraunhofer image is scaled as in cl_fft_col, with LAMBDA (see
+ * utility.hpp) and the lens distance passed by Setup. */
+#define LENS_DISTANCE 0.005f
+
+#define TOLERANCE 1e-4
+#define FRESNEL_RATE 0.001
+#define WIDE_TOLERANCE 1e-10
+#define WIDE_IMAGE_TOLERANCE 1e-6
+
+#define PUPIL_SIZE 128
+#define PUPIL_BANDS 3
+
+#define WEDGE_SIZE 256
+#define WEDGE_SAMPLES 256
+#define WEDGE_ORDER 6
+#define WEDGE_BLOCK 4
+#define WEDGE_FLOOR 1e-4
+#define WEDGE_TOLERANCE 2
+
+#define STORAGE_SIZE 512
+#define STORAGE_SAMPLES 32
+#define STORAGE_TOLERANCE (1.0 / 128)
+
+struct Case
+{
+    const char *input;
+    size_t dim_x, dim_y;
+};
+
+/* A build of the FFT kernels checked by Check and CheckPruned, with the rate
+ * of its Fresnel chirp (see fft.cl), or 0 for the far field. */
+struct Variant
+{
+    cl::Program program;
+    bool stockham, wide;
+    double fresnel;
+};
+
+/* The shape is centered (x, y) pixels from the center of the image, and the
+ * batch holds tiles copies of it, each a pixel further down and right. */
+struct Pruned
+{
+    const char *input;
+    size_t dim_x, dim_y, tiles;
+    int x, y;
+};
+
+const Case cases[] = {
+    { "random", 64, 64 },   { "random", 256, 256 }, { "random", 1024, 1024 },
+    { "random", 512, 128 }, { "random", 128, 512 },
+    { "rect", 256, 256 },   { "rect", 512, 256 },
+    { "circle", 256, 256 }, { "circle", 512, 512 }
+};
+
+struct Error
+{
+    std::string algorithm, input;
+    size_t dim_x, dim_y;
+    double max, rms, image;
+    double analytic;        /* Negative if there is no closed form. */
+};
+
+const Case cpuCases[] = {
+    { "random", 256, 256 }, { "random", 512, 128 }, { "random", 64, 1024 },
+    { "random", 8, 32 }
+};
+
+/* The chirp-z cases: an off-center shape in a pruned window, with the given
+ * number of bands (the reddest ones of which reach past Nyquist). */
+const Pruned chirps[] = {
+    { "circle", 128, 128, 4, -20, 30 }, { "rect", 256, 128, 3, 40, -10 }
+};
+
+/* The pupil of the circle (of radius PUPIL_SIZE / 8), in nanometers. */
+const Aberration pupil = { 0.125f, 60, 40, -30, 50, 20, 30 };
+
+/* The out-of-core cases: the aperture is streamed through the device in the
+ * given number of blocks (of rows, then of columns), and its image decimated
+ * by factor. */
+struct Decimated
+{
+    const char *input;
+    size_t dim_x, dim_y, blocks, factor;
+};
+
+const Decimated decimated[] = {
+    { "random", 512, 256, 8, 2 }, { "circle", 256, 512, 4, 4 }
+};
+
+const Pruned pruned[] = {
+    { "rect", 256, 256, 1, 60, -40 },   { "circle", 256, 256, 1, -50, 70 },
+    { "rect", 512, 256, 1, 100, 30 },   { "circle", 128, 512, 1, 20, -150 },
+    { "circle", 256, 256, 4, 40, 40 },  { "rect", 256, 128, 8, -60, -20 }
+};
+
+/* Shapes are centered on the image, or shifted by (cx, cy) pixels. */
+static void Generate(const std::string &input, size_t dim_x, size_t dim_y,
+                     std::vector<complex> &v, int cx = 0, int cy = 0)
+{
+    srand(1);
+
+    for (size_t y = 0; y < dim_y; ++y)
+        for (size_t x = 0; x < dim_x; ++x)
+        {
+            double dx = (double)x - dim_x / 2 - cx;
+            double dy = (double)y - dim_y / 2 - cy;
+            double value = 0;
+
+            if (input == "random")
+            {
+                double re = 2.0 * rand() / RAND_MAX - 1;
+                double im = 2.0 * rand() / RAND_MAX - 1;
+                v[y * dim_x + x] = complex(re, im);
+                continue;
+            }
+            else if (input == "rect")
+                value = (fabs(dx + 0.5) < dim_x / 16.0)
+                     && (fabs(dy + 0.5) < dim_y / 32.0);
+            else if (input == "circle")
+            {
+                double r = std::min(dim_x, dim_y) / 8.0;
+                value = dx * dx + dy * dy < r * r;
+            }
+
+            v[y * dim_x + x] = value;
+        }
+}
+
+/* Transforms n points, spaced by stride, with twiddles w (of n entries). */
+static void DFT(complex *v, size_t n, size_t stride,
+                const std::vector<complex> &w, std::vector<complex> &tmp)
+{
+    for (size_t k = 0; k < n; ++k)
+    {
+        complex sum = 0;
+        for (size_t t = 0; t < n; ++t) sum += v[t * stride] * w[(t * k) % n];
+        tmp[k] = sum;
+    }
+
+    for (size_t k = 0; k < n; ++k) v[k * stride] = tmp[k];
+}
+
+/* Multiplies a batch of inputs by the Fresnel chirp, as fresnel in fft.cl. */
+static void Chirp(std::vector<complex> &v, size_t dim_x, size_t dim_y,
+                  double rate)
+{
+    for (size_t t = 0; t < v.size(); ++t)
+    {
+        double x = (double)(t % dim_x) - dim_x / 2;
+        double y = (double)((t / dim_x) % dim_y) - dim_y / 2;
+        v[t] *= std::polar(1.0, rate * (x * x + y * y));
+    }
+}
+
+static void Reference(std::vector<complex> &v, size_t dim_x, size_t dim_y)
+{
+    std::vector<complex> w_x(dim_x), w_y(dim_y);
+    std::vector<complex> tmp(std::max(dim_x, dim_y));
+
+    for (size_t k = 0; k < dim_x; ++k)
+        w_x[k] = std::polar(1.0, -2 * M_PI * k / dim_x);
+    for (size_t k = 0; k < dim_y; ++k)
+        w_y[k] = std::polar(1.0, -2 * M_PI * k / dim_y);
+
+    for (size_t y = 0; y < dim_y; ++y) DFT(&v[y * dim_x], dim_x, 1, w_x, tmp);
+    for (size_t x = 0; x < dim_x; ++x) DFT(&v[x], dim_y, dim_x, w_y, tmp);
+}
+
+/* Returns the closed form magnitude of the spectrum at frequency (u, v). */
+static double Analytic(const std::string &input, size_t dim_x, size_t dim_y,
+                       size_t u, size_t v)
+{
+    /* Signed frequencies, in cycles per pixel. */
+    double fx = ((u <= dim_x / 2) ? (double)u : (double)u - dim_x) / dim_x;
+    double fy = ((v <= dim_y / 2) ? (double)v : (double)v - dim_y) / dim_y;
+
+    if (input == "rect")
+    {
+        double wx = dim_x / 8, wy = dim_y / 16;
+        double dx = (fx == 0) ? wx : sin(M_PI * fx * wx) / sin(M_PI * fx);
+        double dy = (fy == 0) ? wy : sin(M_PI * fy * wy) / sin(M_PI * fy);
+        return fabs(dx * dy);
+    }
+
+    double r = std::min(dim_x, dim_y) / 8.0, area = M_PI * r * r;
+    double q = 2 * M_PI * r * sqrt(fx * fx + fy * fy);
+    return (q == 0) ? area : fabs(area * 2 * j1(q) / q);
+}
+
+/* Writes v to the xy slots of an FFT buffer, in float4 or double4. */
+static void Upload(cl::CommandQueue queue, cl::Buffer buffer,
+                   const std::vector<complex> &v, bool wide)
+{
+    std::vector<cl_double4> wides(wide ? v.size() : 0);
+    std::vector<cl_float4> floats(wide ? 0 : v.size());
+
+    for (size_t t = 0; t < v.size(); ++t)
+    {
+        if (wide)
+        {
+            wides[t].s[0] = v[t].real(); wides[t].s[1] = v[t].imag();
+            wides[t].s[2] = wides[t].s[3] = 0;
+        }
+        else
+        {
+            floats[t].s[0] = (float)v[t].real();
+            floats[t].s[1] = (float)v[t].imag();
+            floats[t].s[2] = floats[t].s[3] = 0;
+        }
+    }
+
+    size_t size = v.size() * (wide ? sizeof(cl_double4) : sizeof(cl_float4));
+    queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size,
+                             wide ? (void*)&wides[0] : (void*)&floats[0]);
+}
+
+/* Reads the given slot (0 for xy, 2 for zw) of an FFT buffer into v. */
+static void Download(cl::CommandQueue queue, cl::Buffer buffer,
+                     std::vector<complex> &v, size_t slot, bool wide)
+{
+    std::vector<cl_double4> wides(wide ? v.size() : 0);
+    std::vector<cl_float4> floats(wide ? 0 : v.size());
+
+    size_t size = v.size() * (wide ? sizeof(cl_double4) : sizeof(cl_float4));
+    queue.enqueueReadBuffer(buffer, CL_TRUE, 0, size,
+                            wide ? (void*)&wides[0] : (void*)&floats[0]);
+
+    for (size_t t = 0; t < v.size(); ++t)
+    {
+        if (wide) v[t] = complex(wides[t].s[slot], wides[t].s[slot + 1]);
+        else v[t] = complex(floats[t].s[slot], floats[t].s[slot + 1]);
+    }
+}
+
+/* Returns the name of a variant, as reported. */
+static std::string Algorithm(const Variant &v)
+{
+    std::string name = v.stockham ? "stockham" : "cooley-tukey";
+    if (v.fresnel != 0) name += " fresnel";
+    return v.wide ? name + " double" : name;
+}
+
+/* The Stockham result is left in zw if one axis has an odd number of stages
+ * and the other an even one (see COL_SLOT in fft.cl). */
+static size_t Slot(const Variant &v, size_t dim_x, size_t dim_y)
+{
+    bool odd_x = (radix(dim_x) & 1) != 0, odd_y = (radix(dim_y) & 1) != 0;
+    return (v.stockham && (odd_x != odd_y)) ? 2 : 0;
+}
+
+static Error Check(cl::Context context, cl::CommandQueue queue,
+                   const Variant &v, const Case &c)
+{
+    size_t dim_x = c.dim_x, dim_y = c.dim_y, count = dim_x * dim_y;
+    std::vector<complex> reference(count), data(count);
+    Generate(c.input, dim_x, dim_y, reference);
+
+    Pipeline p;
+    Setup(context, queue, v.program, dim_x, dim_y, p, 1, false, v.wide);
+    Upload(queue, p.data, reference, v.wide);
+    RunTransform(queue, p);
+
+    std::vector<float> image(count);
+    cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = dim_x; rgn[1] = dim_y; rgn[2] = 1;
+    Download(queue, p.data, data, Slot(v, dim_x, dim_y), v.wide);
+    queue.enqueueReadImage(p.fraunhofer, CL_TRUE, origin, rgn, 0, 0,
+                           &image[0]);
+
+    if (v.fresnel != 0) Chirp(reference, dim_x, dim_y, v.fresnel);
+    Reference(reference, dim_x, dim_y);
+
+    /* The chirp has no closed form here. */
+    Error error;
+    error.algorithm = Algorithm(v);
+    error.input = c.input;
+    error.dim_x = dim_x; error.dim_y = dim_y;
+    error.max = error.rms = error.image = 0;
+    error.analytic = (error.input == "random") || v.fresnel ? -1 : 0;
+
+    double peak = 0, energy = 0, residual = 0;
+    for (size_t t = 0; t < count; ++t)
+        peak = std::max(peak, std::abs(reference[t]));
+
+    double norm = (double)count;
+    double scale = 1 / (pow(LAMBDA * LENS_DISTANCE, 2) * norm * norm);
+    double brightest = peak * peak * scale;
+
+    for (size_t y = 0; y < dim_y; ++y)
+        for (size_t x = 0; x < dim_x; ++x)
+        {
+            complex ref = reference[y * dim_x + x];
+            double e = std::abs(data[y * dim_x + x] - ref);
+
+            error.max = std::max(error.max, e / peak);
+            energy += std::norm(ref); residual += e * e;
+
+            size_t px = (x + dim_x / 2) % dim_x, py = (y + dim_y / 2) % dim_y;
+            double expected = std::norm(ref) * scale;
+            double e2 = fabs(image[py * dim_x + px] - expected);
+            error.image = std::max(error.image, e2 / brightest);
+
+            if (error.analytic < 0) continue;
+            double a = Analytic(c.input, dim_x, dim_y, x, y);
+            double e3 = fabs(std::abs(ref) - a) / peak;
+            error.analytic = std::max(error.analytic, e3);
+        }
+
+    error.rms = sqrt(residual / energy);
+    return error;
+}
+
+static Error CheckPruned(cl::Context context, cl::CommandQueue queue,
+                         const Variant &v, const Pruned &c)
+{
+    size_t dim_x = c.dim_x, dim_y = c.dim_y, count = dim_x * dim_y;
+    std::vector<complex> reference(count * c.tiles);
+    std::vector<complex> data(count * c.tiles);
+    Bounds bounds = { dim_x, dim_y, 0, 0 };
+
+    for (size_t t = 0; t < c.tiles; ++t)
+    {
+        std::vector<complex> tile(count);
+        Generate(c.input, dim_x, dim_y, tile, c.x + t, c.y + t);
+        std::copy(tile.begin(), tile.end(), data.begin() + t * count);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (tile[i] == 0.0) continue;
+
+            size_t x = i % dim_x, y = i / dim_x;
+            bounds.x0 = std::min(bounds.x0, x);
+            bounds.x1 = std::max(bounds.x1, x + 1);
+            bounds.y0 = std::min(bounds.y0, y);
+            bounds.y1 = std::max(bounds.y1, y + 1);
+        }
+
+        if (v.fresnel != 0) Chirp(tile, dim_x, dim_y, v.fresnel);
+        Reference(tile, dim_x, dim_y);
+        std::copy(tile.begin(), tile.end(), reference.begin() + t * count);
+    }
+
+    Pipeline p;
+    Setup(context, queue, v.program, dim_x, dim_y, p, c.tiles, false, v.wide);
+    CLParams params = { (cl_uint)dim_x, (cl_uint)radix(dim_x),
+                        (cl_uint)dim_y, (cl_uint)radix(dim_y) };
+    p.window = PruneWindow(bounds, params, v.stockham);
+    p.row.setArg(3, sizeof(p.window), &p.window);
+    p.col.setArg(3, sizeof(p.window), &p.window);
+
+    Upload(queue, p.data, data, v.wide);
+    RunTransform(queue, p);
+
+    /* The images of the tiles are stacked, a row of zeros apart. */
+    size_t height = c.tiles * (dim_y + 1) - 1;
+    std::vector<float> image(dim_x * height);
+    cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = dim_x; rgn[1] = height; rgn[2] = 1;
+    Download(queue, p.data, data, Slot(v, dim_x, dim_y), v.wide);
+    queue.enqueueReadImage(p.fraunhofer, CL_TRUE, origin, rgn, 0, 0,
+                           &image[0]);
+
+    char input[64];
+    sprintf(input, "pruned %s x%u", c.input, (unsigned)c.tiles);
+
+    Error error;
+    error.algorithm = Algorithm(v);
+    error.input = input;
+    error.dim_x = dim_x; error.dim_y = dim_y;
+    error.max = error.rms = error.image = 0;
+    error.analytic = -1;
+
+    double peak = 0, energy = 0, residual = 0;
+    for (size_t t = 0; t < reference.size(); ++t)
+        peak = std::max(peak, std::norm(reference[t]));
+
+    double norm = (double)count;
+    double scale = 1 / (pow(LAMBDA * LENS_DISTANCE, 2) * norm * norm);
+
+    for (size_t t = 0; t < c.tiles; ++t)
+        for (size_t y = 0; y < dim_y; ++y)
+            for (size_t x = 0; x < dim_x; ++x)
+            {
+                size_t i = t * count + y * dim_x + x;
+                double ref = std::norm(reference[i]);
+                double e = fabs(std::norm(data[i]) - ref);
+
+                error.max = std::max(error.max, e / peak);
+                energy += ref * ref; residual += e * e;
+
+                size_t px = (x + dim_x / 2) % dim_x;
+                size_t py = (y + dim_y / 2) % dim_y + t * (dim_y + 1);
+                double e2 = fabs(image[py * dim_x + px] - ref * scale);
+                error.image = std::max(error.image, e2 / (peak * scale));
+            }
+
+    error.rms = sqrt(residual / energy);
+    return error;
+}
+
+/* Runs the out-of-core FFT (see outofcore.hpp) with a block budget small
+ * enough for the given number of blocks, and compares its image with that of
+ * the in-core one, averaged over squares of factor^2 pixels. */
+static Error CheckOutOfCore(cl::Context context, cl::CommandQueue queue,
+                            const Variant &v, const Decimated &c)
+{
+    size_t dim_x = c.dim_x, dim_y = c.dim_y, count = dim_x * dim_y;
+    size_t factor = c.factor, small_x = dim_x / factor;
+    size_t small_y = dim_y / factor;
+    std::vector<complex> input(count);
+    Generate(c.input, dim_x, dim_y, input);
+
+    Pipeline p;
+    Setup(context, queue, v.program, dim_x, dim_y, p, 1, false, v.wide);
+    Upload(queue, p.data, input, v.wide);
+    RunTransform(queue, p);
+
+    std::vector<float> image(count);
+    cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = dim_x; rgn[1] = dim_y; rgn[2] = 1;
+    queue.enqueueReadImage(p.fraunhofer, CL_TRUE, origin, rgn, 0, 0,
+                           &image[0]);
+
+    std::vector<cl::Device> devices;
+    context.getInfo(CL_CONTEXT_DEVICES, &devices);
+    size_t element = v.wide ? sizeof(cl_double4) : sizeof(cl_float4);
+
+    char name[64];
+    sprintf(name, "%s /%u", c.input, (unsigned)factor);
+
+    Error error;
+    error.algorithm = "ooc " + Algorithm(v);
+    error.input = name;
+    error.dim_x = dim_x; error.dim_y = dim_y;
+    error.max = error.rms = error.image = 0;
+    error.analytic = -1;
+
+    /* A plan which does not decimate by factor, or splits the axes into any
+     * other number of blocks, would not check what it is meant to. */
+    OutOfCore ooc;
+    bool planned = PlanOutOfCore(context, devices[0], v.program, dim_x, dim_y,
+                                 element, count * element / c.blocks, factor,
+                                 v.stockham, "", ooc);
+
+    if (!planned || (ooc.factor != factor) || (ooc.rows * c.blocks != dim_y)
+        || (ooc.cols * c.blocks != dim_x))
+    {
+        if (planned) ReleaseOutOfCore(ooc);
+        error.max = error.image = 1;
+        return error;
+    }
+
+    for (size_t t = 0; t < count; ++t)
+    {
+        char *e = ooc.scratch + t * element;
+        if (v.wide)
+        {
+            cl_double4 value = {{ input[t].real(), input[t].imag(), 0, 0 }};
+            memcpy(e, &value, element);
+        }
+        else
+        {
+            cl_float4 value = {{ (float)input[t].real(),
+                                 (float)input[t].imag(), 0, 0 }};
+            memcpy(e, &value, element);
+        }
+    }
+
+    cl::ImageFormat format(CL_INTENSITY, CL_FLOAT);
+    cl::Image2D small(context, CL_MEM_READ_WRITE, format, small_x, small_y);
+    Profile profile = CreateProfile(false);
+    RunOutOfCore(queue, ooc, small, 0, LENS_DISTANCE, 1, profile, 0);
+    ReleaseOutOfCore(ooc);
+
+    std::vector<float> result(small_x * small_y);
+    rgn[0] = small_x; rgn[1] = small_y;
+    queue.enqueueReadImage(small, CL_TRUE, origin, rgn, 0, 0, &result[0]);
+
+    std::vector<double> expected(small_x * small_y);
+    double brightest = 0, energy = 0, residual = 0;
+    for (size_t y = 0; y < dim_y; ++y)
+        for (size_t x = 0; x < dim_x; ++x)
+            expected[(y / factor) * small_x + x / factor]
+                += image[y * dim_x + x] / (double)(factor * factor);
+
+    for (size_t t = 0; t < expected.size(); ++t)
+        brightest = std::max(brightest, expected[t]);
+
+    for (size_t t = 0; t < expected.size(); ++t)
+    {
+        double e = fabs(result[t] - expected[t]);
+        error.image = std::max(error.image, e / brightest);
+        energy += expected[t] * expected[t]; residual += e * e;
+    }
+
+    error.max = error.image;
+    error.rms = sqrt(residual / energy);
+    return error;
+}
+
+/* Checks the CPU backend with each instruction set and method. */
+static void CheckCPU(const Case &c, std::vector<Error> &errors)
+{
+    size_t dim_x = c.dim_x, dim_y = c.dim_y, count = dim_x * dim_y;
+    std::vector<complex> input(count);
+    Generate(c.input, dim_x, dim_y, input);
+    std::vector<complex> reference(input);
+    Reference(reference, dim_x, dim_y);
+
+    double peak = 0;
+    for (size_t t = 0; t < count; ++t)
+        peak = std::max(peak, std::abs(reference[t]));
+
+    std::vector<std::string> isas = CpuISAs();
+    for (size_t i = 0; i < 2 * isas.size(); ++i)
+    {
+        bool sixStep = (i & 1) != 0;
+        CpuUseISA(isas[i / 2]);
+
+        std::vector<float> re(count), im(count);
+        for (size_t t = 0; t < count; ++t)
+        {
+            re[t] = (float)input[t].real();
+            im[t] = (float)input[t].imag();
+        }
+
+        CpuTransform(&re[0], &im[0], dim_x, dim_y,
+                     sixStep ? CPU_SIX_STEP : CPU_COLUMNS);
+
+        /* There is no image, so image is zero. */
+        Error error;
+        error.algorithm = "cpu " + isas[i / 2] + (sixStep ? " six-step" : "");
+        error.input = c.input;
+        error.dim_x = dim_x; error.dim_y = dim_y;
+        error.max = error.rms = error.image = 0;
+        error.analytic = -1;
+
+        double energy = 0, residual = 0;
+        for (size_t t = 0; t < count; ++t)
+        {
+            double e = std::abs(complex(re[t], im[t]) - reference[t]);
+            error.max = std::max(error.max, e / peak);
+            energy += std::norm(reference[t]); residual += e * e;
+        }
+
+        error.rms = sqrt(residual / energy);
+        errors.push_back(error);
+    }
+
+    CpuUseISA("");
+}
+
+/* Transforms n points, spaced by stride, at frequencies s (k - n/2) / n. */
+static void Scaled(complex *v, size_t n, size_t stride, double s,
+                   std::vector<complex> &tmp)
+{
+    for (size_t k = 0; k < n; ++k)
+    {
+        double f = s * ((double)k - n / 2) / n;
+        complex sum = 0;
+        for (size_t t = 0; t < n; ++t)
+            sum += v[t * stride] * std::polar(1.0, -2 * M_PI * f * t);
+        tmp[k] = sum;
+    }
+
+    for (size_t k = 0; k < n; ++k) v[k * stride] = tmp[k];
+}
+
+/* Checks every band of a chirp-z case, the tiles of which are its bands. */
+static void CheckChirp(cl::Context context, cl::CommandQueue queue,
+                       cl::Program program, const Pruned &c,
+                       std::vector<Error> &errors)
+{
+    size_t dim_x = c.dim_x, dim_y = c.dim_y, count = dim_x * dim_y;
+    size_t bands = c.tiles;
+    std::vector<complex> aperture(count);
+    Generate(c.input, dim_x, dim_y, aperture, c.x, c.y);
+
+    std::vector<cl_float4> data(count);
+    Bounds bounds = { dim_x, dim_y, 0, 0 };
+    for (size_t t = 0; t < count; ++t)
+    {
+        data[t].s[0] = (float)aperture[t].real();
+        data[t].s[1] = data[t].s[2] = data[t].s[3] = 0;
+        if (aperture[t] == 0.0) continue;
+
+        size_t x = t % dim_x, y = t / dim_x;
+        bounds.x0 = std::min(bounds.x0, x);
+        bounds.x1 = std::max(bounds.x1, x + 1);
+        bounds.y0 = std::min(bounds.y0, y);
+        bounds.y1 = std::max(bounds.y1, y + 1);
+    }
+
+    CLParams params = { (cl_uint)dim_x, (cl_uint)radix(dim_x),
+                        (cl_uint)dim_y, (cl_uint)radix(dim_y) };
+    CLParams window = PruneWindow(bounds, params, false);
+    size_t rows = (size_t)1 << window.rad_y;
+
+    size_t size = count * sizeof(cl_float4), height = bands * (dim_y + 1) - 1;
+    cl::Buffer v(context, CL_MEM_READ_WRITE, size);
+    cl::Buffer scratch(context, CL_MEM_READ_WRITE, 2 * size);
+    cl::Buffer table_x = ChirpTable(context, dim_x, bands, false);
+    cl::Buffer table_y = ChirpTable(context, dim_y, bands, false);
+    cl::ImageFormat format(CL_INTENSITY, CL_FLOAT);
+    cl::Image2D image(context, CL_MEM_READ_WRITE, format, dim_x, height, 0);
+    queue.enqueueWriteBuffer(v, CL_TRUE, 0, size, &data[0]);
+
+    cl_uint bandCount = bands;
+    cl_float lensDistance = LENS_DISTANCE, gain = 1;
+    cl::Kernel row(program, "cl_chirp_row"), col(program, "cl_chirp_col");
+    row.setArg(0, v);
+    row.setArg(1, sizeof(params), &params);
+    row.setArg(2, sizeof(window), &window);
+    row.setArg(3, scratch);
+    row.setArg(4, table_x);
+    row.setArg(6, sizeof(cl_uint), &bandCount);
+    col.setArg(0, v);
+    col.setArg(1, sizeof(params), &params);
+    col.setArg(2, sizeof(window), &window);
+    col.setArg(3, scratch);
+    col.setArg(4, table_y);
+    col.setArg(5, image);
+    col.setArg(7, sizeof(cl_uint), &bandCount);
+    col.setArg(8, sizeof(cl_float), &lensDistance);
+    col.setArg(9, sizeof(cl_float), &gain);
+
+    for (cl_uint band = 0; band < bands; ++band)
+    {
+        row.setArg(5, sizeof(cl_uint), &band);
+        col.setArg(6, sizeof(cl_uint), &band);
+        queue.enqueueNDRangeKernel(row, cl::NDRange(0), cl::NDRange(rows),
+                                   cl::NullRange);
+        queue.enqueueNDRangeKernel(col, cl::NDRange(0), cl::NDRange(dim_x),
+                                   cl::NullRange);
+    }
+
+    std::vector<float> pixels(dim_x * height);
+    cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = dim_x; rgn[1] = height; rgn[2] = 1;
+    queue.enqueueReadImage(image, CL_TRUE, origin, rgn, 0, 0, &pixels[0]);
+
+    double norm = (double)count;
+    double scale = 1 / (pow(LAMBDA * LENS_DISTANCE, 2) * norm * norm);
+    std::vector<complex> tmp(std::max(dim_x, dim_y));
+
+    for (size_t b = 0; b < bands; ++b)
+    {
+        /* The center wavelength of the band, as BAND in def.cl. */
+        double s = (390 + 400 * (b + 0.5) / bands) / LAMBDA;
+        std::vector<complex> reference(aperture);
+        for (size_t y = 0; y < dim_y; ++y)
+            Scaled(&reference[y * dim_x], dim_x, 1, s, tmp);
+        for (size_t x = 0; x < dim_x; ++x)
+            Scaled(&reference[x], dim_y, dim_x, s, tmp);
+
+        char input[64];
+        sprintf(input, "%s band %u/%u", c.input, (unsigned)b,
+                (unsigned)bands);
+
+        Error error;
+        error.algorithm = "chirp-z";
+        error.input = input;
+        error.dim_x = dim_x; error.dim_y = dim_y;
+        error.max = error.rms = error.image = 0;
+        error.analytic = -1;
+
+        double peak = 0, energy = 0, residual = 0;
+        for (size_t t = 0; t < count; ++t)
+            peak = std::max(peak, std::norm(reference[t]));
+
+        for (size_t y = 0; y < dim_y; ++y)
+            for (size_t x = 0; x < dim_x; ++x)
+            {
+                double fx = s * ((double)x / dim_x - 0.5);
+                double fy = s * ((double)y / dim_y - 0.5);
+                double ref = std::norm(reference[y * dim_x + x]);
+                if ((fabs(fx) > 0.5) || (fabs(fy) > 0.5)) ref = 0;
+
+                float dev = pixels[(b * (dim_y + 1) + y) * dim_x + x];
+                double e = fabs(dev / scale - ref);
+                error.max = std::max(error.max, e / peak);
+                energy += ref * ref; residual += e * e;
+            }
+
+        /* Only the image is read back, so it is what max measures. */
+        error.image = error.max;
+        error.rms = sqrt(residual / energy);
+        errors.push_back(error);
+    }
+}
+
+/* Returns the optical path difference of the Zernike terms at (x, y), relative
+ * to the pupil radius, as x^2 - y^2 = r^2 cos 2t, 2xy = r^2 sin 2t, and so
+ * on. */
+static double Zernike(const Aberration &a, double x, double y)
+{
+    double r2 = x * x + y * y;
+
+    return a.defocus * sqrt(3.0) * (2 * r2 - 1)
+         + a.astigmatismX * sqrt(6.0) * (x * x - y * y)
+         + a.astigmatismY * sqrt(6.0) * (2 * x * y)
+         + a.comaX * sqrt(8.0) * (3 * r2 - 2) * x
+         + a.comaY * sqrt(8.0) * (3 * r2 - 2) * y
+         + a.spherical * sqrt(5.0) * (6 * r2 * r2 - 6 * r2 + 1);
+}
+
+/* Runs cl_pupil on the circle with the given aberration, then the FFT, into
+ * p (a pipeline of one tile per band), returning the spectrum of each band
+ * and the image of all of them. */
+static void Pupil(cl::Context context, cl::CommandQueue queue,
+                  cl::Program program, const Aberration &a, Pipeline &p,
+                  std::vector<complex> &data, std::vector<float> &image)
+{
+    size_t dim = PUPIL_SIZE, count = dim * dim, bands = PUPIL_BANDS;
+    std::vector<complex> input(count * bands);
+    Generate("circle", dim, dim, input);
+
+    Setup(context, queue, program, dim, dim, p, bands);
+    Upload(queue, p.data, input, false);
+
+    std::vector<float> zeros(count);
+    cl::Buffer map(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                   count * sizeof(float), &zeros[0]);
+    CLParams params = { (cl_uint)dim, (cl_uint)radix(dim),
+                        (cl_uint)dim, (cl_uint)radix(dim) };
+    cl_uint bandCount = bands;
+
+    cl::Kernel kernel(program, "cl_pupil");
+    kernel.setArg(0, p.data);
+    kernel.setArg(1, sizeof(params), &params);
+    kernel.setArg(2, map);
+    kernel.setArg(3, sizeof(a), &a);
+    kernel.setArg(4, sizeof(cl_uint), &bandCount);
+    queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(count),
+                               cl::NullRange);
+    RunTransform(queue, p);
+
+    size_t height = bands * (dim + 1) - 1;
+    cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = dim; rgn[1] = height; rgn[2] = 1;
+    data.resize(count * bands); image.resize(dim * height);
+    Download(queue, p.data, data, 0, false);
+    queue.enqueueReadImage(p.fraunhofer, CL_TRUE, origin, rgn, 0, 0,
+                           &image[0]);
+}
+
+/* Checks every band of the aberrated pupil, and returns the largest
+ * difference between the image of any band of the unaberrated one and that
+ * of the plain circle (which should be none at all). */
+static double CheckPupil(cl::Context context, cl::CommandQueue queue,
+                         cl::Program program, std::vector<Error> &errors)
+{
+    size_t dim = PUPIL_SIZE, count = dim * dim, bands = PUPIL_BANDS;
+    std::vector<complex> circle(count), data;
+    std::vector<float> image;
+    Generate("circle", dim, dim, circle);
+
+    Pipeline p;
+    Pupil(context, queue, program, pupil, p, data, image);
+
+    double norm = (double)count;
+    double scale = 1 / (pow(LAMBDA * LENS_DISTANCE, 2) * norm * norm);
+
+    for (size_t b = 0; b < bands; ++b)
+    {
+        /* The center wavelength of the band, as BAND in def.cl. */
+        double band = 390 + 400 * (b + 0.5) / bands;
+        std::vector<complex> reference(count);
+        for (size_t t = 0; t < count; ++t)
+        {
+            double x = ((double)(t % dim) - dim / 2) / (pupil.radius * dim);
+            double y = ((double)(t / dim) - dim / 2) / (pupil.radius * dim);
+            double phase = 2 * M_PI * Zernike(pupil, x, y) / band;
+            reference[t] = circle[t] * std::polar(1.0, phase);
+        }
+
+        Reference(reference, dim, dim);
+
+        char input[64];
+        sprintf(input, "circle band %u/%u", (unsigned)b, (unsigned)bands);
+
+        Error error;
+        error.algorithm = "pupil";
+        error.input = input;
+        error.dim_x = dim; error.dim_y = dim;
+        error.max = error.rms = error.image = 0;
+        error.analytic = -1;
+
+        double peak = 0, energy = 0, residual = 0;
+        for (size_t t = 0; t < count; ++t)
+            peak = std::max(peak, std::abs(reference[t]));
+
+        for (size_t y = 0; y < dim; ++y)
+            for (size_t x = 0; x < dim; ++x)
+            {
+                complex ref = reference[y * dim + x];
+                double e = std::abs(data[b * count + y * dim + x] - ref);
+                error.max = std::max(error.max, e / peak);
+                energy += std::norm(ref); residual += e * e;
+
+                size_t px = (x + dim / 2) % dim;
+                size_t py = (y + dim / 2) % dim + b * (dim + 1);
+                double e2 = fabs(image[py * dim + px] - std::norm(ref) * scale);
+                error.image = std::max(error.image, e2 / (peak * peak * scale));
+            }
+
+        error.rms = sqrt(residual / energy);
+        errors.push_back(error);
+    }
+
+    /* Without aberrations, every band is the plain circle. */
+    Aberration none = { pupil.radius, 0, 0, 0, 0, 0, 0 };
+    Pupil(context, queue, program, none, p, data, image);
+
+    Pipeline plain;
+    Setup(context, queue, program, dim, dim, plain);
+    Upload(queue, plain.data, circle, false);
+    RunTransform(queue, plain);
+
+    std::vector<float> expected(count);
+    cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = dim; rgn[1] = dim; rgn[2] = 1;
+    queue.enqueueReadImage(plain.fraunhofer, CL_TRUE, origin, rgn, 0, 0,
+                           &expected[0]);
+
+    double difference = 0;
+    for (size_t b = 0; b < bands; ++b)
+        for (size_t t = 0; t < count; ++t)
+        {
+            float pixel = image[b * (dim + 1) * dim + t];
+            difference = std::max(difference, fabs(pixel - expected[t]));
+        }
+
+    return difference;
+}
+
+/* Reads a render of WEDGE_SAMPLES per pixel, returning the mean luminance (Y)
+ * of each square of WEDGE_BLOCK^2 pixels, and the number of pixels which do
+ * not hold exactly that many samples. */
+static size_t Blocks(cl::CommandQueue queue, cl::Buffer render, size_t dim,
+                     std::vector<double> &blocks)
+{
+    size_t count = dim * dim, n = dim / WEDGE_BLOCK, uncovered = 0;
+    std::vector<cl_float4> pixels(count);
+    queue.enqueueReadBuffer(render, CL_TRUE, 0, count * sizeof(cl_float4),
+                            &pixels[0]);
+
+    blocks.assign(n * n, 0);
+    for (size_t t = 0; t < count; ++t)
+    {
+        size_t x = (t % dim) / WEDGE_BLOCK, y = (t / dim) / WEDGE_BLOCK;
+        blocks[y * n + x] += pixels[t].s[1] / pixels[t].s[3];
+        uncovered += (pixels[t].s[3] != WEDGE_SAMPLES);
+    }
+
+    return uncovered;
+}
+
+/* Returns the mean relative difference between the blocks of two renders,
+ * over those of the first at least WEDGE_FLOOR times its brightest. */
+static double Difference(const std::vector<double> &a,
+                         const std::vector<double> &b)
+{
+    double peak = *std::max_element(a.begin(), a.end()), sum = 0;
+    size_t blocks = 0;
+
+    for (size_t t = 0; t < a.size(); ++t)
+    {
+        if (a[t] < WEDGE_FLOOR * peak) continue;
+        sum += 2 * fabs(a[t] - b[t]) / (a[t] + b[t]);
+        ++blocks;
+    }
+
+    return sum / std::max(blocks, (size_t)1);
+}
+
+/* Renders the hexagon both in full (with cl_lens, and again with another
+ * seed for the noise) and as one wedge of order 6 filled in by cl_replicate,
+ * into a buffer cleared beforehand so that any pixel left out shows up as
+ * uncovered, and returns the difference of each from the first render. */
+static void CheckWedge(cl::Context context, cl::CommandQueue queue,
+                       cl::Program program, double &difference,
+                       double &noise, size_t &uncovered)
+{
+    size_t dim = WEDGE_SIZE, count = dim * dim;
+    Pipeline p;
+    Setup(context, queue, program, dim, dim, p);
+
+    /* The Iris of bench.cpp, antialiased: the staircase edges of a plain
+     * one make its pattern visibly less symmetric in the faint wings. */
+    ProceduralAperture shape;
+    shape.blades = 6; shape.radius = 0.1f; shape.rotation = 0;
+    shape.roundness = 0; shape.obstruction = 0; shape.vanes = 0;
+    shape.vaneWidth = 0; shape.dust = 0; shape.dustSize = 0.01f;
+    shape.seed = 0; shape.supersampling = 4;
+
+    p.generator.setArg(2, sizeof(shape), &shape);
+    queue.enqueueNDRangeKernel(p.generator, cl::NDRange(0),
+                               cl::NDRange(count), cl::NullRange);
+    RunTransform(queue, p);
+
+    std::vector<double> full, other, wedge;
+    RunLens(queue, p, WEDGE_SAMPLES);
+    Blocks(queue, p.render, dim, full);
+
+    uint64_t seed = 1;
+    p.lens.setArg(5, sizeof(uint64_t), &seed);
+    RunLens(queue, p, WEDGE_SAMPLES);
+    Blocks(queue, p.render, dim, other);
+
+    std::vector<cl_float4> zeros(count);
+    cl::Buffer render(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                      count * sizeof(cl_float4), &zeros[0]);
+    CLParams params = { (cl_uint)dim, (cl_uint)radix(dim),
+                        (cl_uint)dim, (cl_uint)radix(dim) };
+    cl_uint samples = WEDGE_SAMPLES, prior = 0, order = WEDGE_ORDER;
+    cl_uint bands = 0, scaled = 0;
+    seed = 2;
+
+    cl::Kernel lens(program, "cl_lens_wedge");
+    lens.setArg(0, render);
+    lens.setArg(1, sizeof(params), &params);
+    lens.setArg(2, p.fraunhofer);
+    lens.setArg(3, p.spectrum);
+    lens.setArg(4, sizeof(cl_uint), &samples);
+    lens.setArg(5, sizeof(uint64_t), &seed);
+    lens.setArg(6, sizeof(cl_uint), &prior);
+    lens.setArg(7, sizeof(cl_uint), &order);
+    lens.setArg(8, sizeof(cl_uint), &bands);
+    lens.setArg(9, sizeof(cl_uint), &scaled);
+
+    cl::Kernel replicate(program, "cl_replicate");
+    replicate.setArg(0, render);
+    replicate.setArg(1, sizeof(params), &params);
+    replicate.setArg(2, sizeof(cl_uint), &order);
+
+    queue.enqueueNDRangeKernel(lens, cl::NDRange(0), cl::NDRange(count),
+                               cl::NullRange);
+    queue.enqueueNDRangeKernel(replicate, cl::NDRange(0), cl::NDRange(count),
+                               cl::NullRange);
+    uncovered = Blocks(queue, render, dim, wedge);
+
+    difference = Difference(full, wedge);
+    noise = Difference(full, other);
+}
+
+/* Renders the circle with the given storage, and encodes it as RGBE. */
+static void Render(cl::Context context, cl::CommandQueue queue,
+                   cl::Program program, bool half, std::vector<uint8_t> &rgbe)
+{
+    size_t dim = STORAGE_SIZE, count = dim * dim;
+    std::vector<complex> circle(count);
+    Generate("circle", dim, dim, circle);
+
+    std::vector<cl_float4> data(count);
+    double transmission = 0;
+    for (size_t t = 0; t < count; ++t)
+    {
+        data[t].s[0] = (float)circle[t].real();
+        data[t].s[1] = data[t].s[2] = data[t].s[3] = 0;
+        transmission += circle[t].real();
+    }
+
+    /* As in main.cpp, scaling the central peak to 1. */
+    cl_float gain = 1;
+    if (half) gain = pow(count / transmission, 2)
+                   * pow(LAMBDA * LENS_DISTANCE, 2);
+
+    Pipeline p;
+    Setup(context, queue, program, dim, dim, p, 1, half);
+    p.col.setArg(6, sizeof(cl_float), &gain);
+    queue.enqueueWriteBuffer(p.data, CL_TRUE, 0, count * sizeof(cl_float4),
+                             &data[0]);
+    RunTransform(queue, p);
+    RunLens(queue, p, STORAGE_SAMPLES);
+
+    size_t pixel = half ? 4 * sizeof(cl_half) : sizeof(cl_float4);
+    std::vector<char> pixels(count * pixel);
+    queue.enqueueReadBuffer(p.render, CL_TRUE, 0, pixels.size(), &pixels[0]);
+
+    rgbe.resize(4 * count);
+    EncodeRadiance(&pixels[0], count, half, gain, &rgbe[0]);
+}
+
+static double Decode(const uint8_t *rgbe, size_t channel)
+{
+    if (rgbe[3] == 0) return 0;
+    return (rgbe[channel] + 0.5) * ldexp(1.0, rgbe[3] - 136);
+}
+
+/* Returns the largest and RMS errors of the half render, and the fraction of
+ * its pixels which differ at all from the float one. */
+static void Storage(cl::Context context, cl::CommandQueue queue,
+                    cl::Program program, double &max, double &rms,
+                    double &differ)
+{
+    std::vector<cl::Device> devices;
+    context.getInfo(CL_CONTEXT_DEVICES, &devices);
+    cl::Program half = LoadProgram(context, devices, "-D HALF_STORAGE ");
+
+    std::vector<uint8_t> a, b;
+    Render(context, queue, program, false, a);
+    Render(context, queue, half, true, b);
+
+    size_t count = a.size() / 4, pixels = 0;
+    max = rms = differ = 0;
+
+    for (size_t t = 0; t < count; ++t)
+    {
+        const uint8_t *f = &a[4 * t], *h = &b[4 * t];
+        double brightest = 0, e = 0;
+        for (size_t c = 0; c < 3; ++c)
+            brightest = std::max(brightest, Decode(f, c));
+        if (brightest == 0) continue;
+
+        for (size_t c = 0; c < 3; ++c)
+            e = std::max(e, fabs(Decode(h, c) - Decode(f, c)) / brightest);
+
+        max = std::max(max, e);
+        rms += e * e;
+        differ += (memcmp(f, h, 4) != 0);
+        ++pixels;
+    }
+
+    rms = sqrt(rms / std::max(pixels, (size_t)1));
+    differ /= std::max(pixels, (size_t)1);
+}
+
+bool Accuracy(cl::Context context, cl::CommandQueue queue, cl::Program program,
+              cl::Program stockham, const char *path)
+{
+    std::vector<Error> errors;
+    bool pass = true;
+
+    std::vector<Variant> variants;
+    Variant variant = { program, false, false, 0 };
+    variants.push_back(variant);
+    variant.program = stockham; variant.stockham = true;
+    variants.push_back(variant);
+
+    {
+        std::vector<cl::Device> devices;
+        context.getInfo(CL_CONTEXT_DEVICES, &devices);
+
+        char define[64];
+        sprintf(define, "-D FRESNEL=%.9ef ", FRESNEL_RATE);
+        variant.fresnel = FRESNEL_RATE; variant.stockham = false;
+        variant.program = LoadProgram(context, devices, define);
+        variants.push_back(variant);
+        variant.stockham = true;
+        variant.program = LoadProgram(context, devices,
+                                      define + std::string("-D STOCKHAM "));
+        variants.push_back(variant);
+        variant.fresnel = 0;
+
+        std::string extensions;
+        devices[0].getInfo(CL_DEVICE_EXTENSIONS, &extensions);
+
+        if (extensions.find("cl_khr_fp64") != std::string::npos)
+        {
+            variant.wide = true; variant.stockham = false;
+            variant.program = LoadProgram(context, devices, "-D DOUBLE_FFT ");
+            variants.push_back(variant);
+            variant.stockham = true;
+            variant.program = LoadProgram(context, devices,
+                                          "-D DOUBLE_FFT -D STOCKHAM ");
+            variants.push_back(variant);
+        }
+        else
+            printf("No double precision support, skipping DOUBLE_FFT\n");
+    }
+
+    size_t count = sizeof(cases) / sizeof(*cases);
+    for (size_t t = 0; t < variants.size() * count; ++t)
+    {
+        const Variant &v = variants[t / count];
+        Error e = Check(context, queue, v, cases[t % count]);
+        bool ok = (e.max < (v.wide ? WIDE_TOLERANCE : TOLERANCE))
+               && (e.image < (v.wide ? WIDE_IMAGE_TOLERANCE : TOLERANCE));
+        pass = pass && ok;
+
+        printf("%-12s %-6s %4ux%-4u: max %.3e, rms %.3e, image %.3e",
+               e.algorithm.c_str(), e.input.c_str(),
+               (unsigned)e.dim_x, (unsigned)e.dim_y,
+               e.max, e.rms, e.image);
+        if (e.analytic >= 0) printf(", closed form %.3e", e.analytic);
+        printf("%s\n", ok ? "" : " (FAILED)");
+        errors.push_back(e);
+    }
+
+    count = sizeof(pruned) / sizeof(*pruned);
+    for (size_t t = 0; t < variants.size() * count; ++t)
+    {
+        const Variant &v = variants[t / count];
+        Error e = CheckPruned(context, queue, v, pruned[t % count]);
+        bool ok = (e.max < (v.wide ? WIDE_TOLERANCE : TOLERANCE))
+               && (e.image < (v.wide ? WIDE_IMAGE_TOLERANCE : TOLERANCE));
+        pass = pass && ok;
+
+        printf("%-12s %-6s %4ux%-4u: max %.3e, rms %.3e, image %.3e%s\n",
+               e.algorithm.c_str(), e.input.c_str(),
+               (unsigned)e.dim_x, (unsigned)e.dim_y,
+               e.max, e.rms, e.image, ok ? "" : " (FAILED)");
+        errors.push_back(e);
+    }
+
+    /* Fresnel propagation is never out of core (see main.cpp). */
+    count = sizeof(decimated) / sizeof(*decimated);
+    for (size_t t = 0; t < variants.size() * count; ++t)
+    {
+        const Variant &v = variants[t / count];
+        if (v.fresnel != 0) continue;
+
+        Error e = CheckOutOfCore(context, queue, v, decimated[t % count]);
+        bool ok = e.image < (v.wide ? WIDE_IMAGE_TOLERANCE : TOLERANCE);
+        pass = pass && ok;
+
+        printf("%-12s %-6s %4ux%-4u: max %.3e, rms %.3e%s\n",
+               e.algorithm.c_str(), e.input.c_str(),
+               (unsigned)e.dim_x, (unsigned)e.dim_y,
+               e.max, e.rms, ok ? "" : " (FAILED)");
+        errors.push_back(e);
+    }
+
+    count = sizeof(chirps) / sizeof(*chirps);
+    size_t cpu = sizeof(cpuCases) / sizeof(*cpuCases);
+    double unaberrated = 0;
+    for (size_t t = 0; t < count + cpu + 1; ++t)
+    {
+        std::vector<Error> results;
+        if (t < count) CheckChirp(context, queue, program, chirps[t], results);
+        else if (t < count + cpu) CheckCPU(cpuCases[t - count], results);
+        else unaberrated = CheckPupil(context, queue, program, results);
+
+        for (size_t r = 0; r < results.size(); ++r)
+        {
+            const Error &e = results[r];
+            bool ok = (e.max < TOLERANCE) && (e.image < TOLERANCE);
+            pass = pass && ok;
+
+            printf("%-12s %-6s %4ux%-4u: max %.3e, rms %.3e%s\n",
+                   e.algorithm.c_str(), e.input.c_str(),
+                   (unsigned)e.dim_x, (unsigned)e.dim_y,
+                   e.max, e.rms, ok ? "" : " (FAILED)");
+            errors.push_back(e);
+        }
+    }
+
+    pass = pass && (unaberrated == 0);
+    printf("pupil        circle %ux%u without aberrations: difference %.3e "
+           "from the plain image%s\n", PUPIL_SIZE, PUPIL_SIZE, unaberrated,
+           (unaberrated == 0) ? "" : " (FAILED)");
+
+    double difference, noise;
+    size_t uncovered;
+    CheckWedge(context, queue, program, difference, noise, uncovered);
+    bool ok = (uncovered == 0) && (difference < WEDGE_TOLERANCE * noise);
+    pass = pass && ok;
+    printf("wedge        iris %ux%u, order %u: difference %.3e (noise %.3e), "
+           "%u pixels uncovered%s\n", WEDGE_SIZE, WEDGE_SIZE, WEDGE_ORDER,
+           difference, noise, (unsigned)uncovered, ok ? "" : " (FAILED)");
+
+    double max, rms, differ;
+    Storage(context, queue, program, max, rms, differ);
+    ok = max <= STORAGE_TOLERANCE;
+    pass = pass && ok;
+    printf("half storage circle %ux%u, %u samples: max %.3e, rms %.3e, "
+           "%.1f%% of pixels differ%s\n", STORAGE_SIZE, STORAGE_SIZE,
+           STORAGE_SAMPLES, max, rms, differ * 100, ok ? "" : " (FAILED)");
+
+    if (path)
+    {
+        std::fstream out(path, std::ios::out);
+        out << "{" << std::endl << "  \"tolerance\": " << TOLERANCE << ",";
+        out << std::endl << "  \"wide_tolerance\": " << WIDE_TOLERANCE;
+        out << ", \"wide_image_tolerance\": " << WIDE_IMAGE_TOLERANCE << ",";
+        out << std::endl << "  \"results\": [" << std::endl;
+
+        for (size_t t = 0; t < errors.size(); ++t)
+        {
+            const Error &e = errors[t];
+            char line[512], analytic[32] = "null";
+            if (e.analytic >= 0) sprintf(analytic, "%.6e", e.analytic);
+            sprintf(line, "    {\"algorithm\": \"%s\", \"input\": \"%s\", "
+                    "\"dim_x\": %u, \"dim_y\": %u, \"max\": %.6e, "
+                    "\"rms\": %.6e, \"image\": %.6e, \"analytic\": %s}%s",
+                    e.algorithm.c_str(), e.input.c_str(),
+                    (unsigned)e.dim_x, (unsigned)e.dim_y,
+                    e.max, e.rms, e.image, analytic,
+                    (t + 1 < errors.size()) ? "," : "");
+            out << line << std::endl;
+        }
+
+        char line[256];
+        sprintf(line, "  \"storage\": {\"size\": %u, \"samples\": %u, "
+                "\"tolerance\": %.6e, \"max\": %.6e, \"rms\": %.6e, "
+                "\"differ\": %.6e}", STORAGE_SIZE, STORAGE_SAMPLES,
+                STORAGE_TOLERANCE, max, rms, differ);
+        out << "  ]," << std::endl << line << "," << std::endl;
+        sprintf(line, "  \"wedge\": {\"size\": %u, \"order\": %u, "
+                "\"difference\": %.6e, \"noise\": %.6e, \"uncovered\": %u},",
+                WEDGE_SIZE, WEDGE_ORDER, difference, noise,
+                (unsigned)uncovered);
+        out << line << std::endl;
+        out << "  \"unaberrated\": " << unaberrated << std::endl;
+        out << "}" << std::endl;
+    }
+
+    std::cout << (pass ? "All within " : "Some exceed ") << TOLERANCE;
+    std::cout << std::endl;
+    return pass;
+}
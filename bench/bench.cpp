@@ -0,0 +1,545 @@
+#include <spectrum.hpp>
+#include <pugixml.hpp>
+#include <utility.hpp>
+#include <aperture.hpp>
+#include <output.hpp>
+#include <cpufft.hpp>
+#include <bench.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cmath>
+
+/* Benchmark harness for the stages of a render: the two FFT kernels (built
+ * both as Cooley-Tukey and as Stockham, see fft.cl), the CPU FFT, cl_lens,
+ * the PPM reader and the RGBE writer, over a range of sizes (and of sample
+ * counts for cl_lens). Every measurement is repeated after a few untimed
+ * warmup runs; device stages are timed from their profiling events and host
+ * stages by wall clock. Results are printed, and optionally saved as JSON
+ * along with the platform, device and driver so that runs can be compared.
+ * With --accuracy, the FFT is checked against a reference DFT instead (see
+ * accuracy.cpp). */
+
+#define WARMUP 2
+#define REPETITIONS 5
+
+const size_t sizes[] = { 256, 512, 1024, 2048, 4096, 8192 };
+const size_t sampleCounts[] = { 1, 8, 32 };
+
+/* Sizes up to BATCH_SIZE are also transformed in batches of BATCH_TILES (or
+ * as many as fit), as for many small renders. */
+#define BATCH_SIZE 512
+#define BATCH_TILES 64
+
+/* Sizes up to CPU_SIZE are also transformed on the host (see cpufft.hpp), and
+ * up to CPU_LOOP_SIZE by a plain loop for comparison. */
+#define CPU_SIZE 8192
+#define CPU_LOOP_SIZE 2048
+
+struct Result
+{
+    std::string benchmark;
+    size_t size, samples;
+    double best, mean;          /* Seconds per repetition. */
+    double gflops, gbps, msps;  /* At the best time, 0 if not applicable. */
+};
+
+double Elapsed(const cl::Event &event)
+{
+    cl_ulong start = 0, end = 0;
+    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+    return (end - start) * 1e-9;
+}
+
+static Result Summarize(const std::string &benchmark, size_t size,
+                        size_t samples, const std::vector<double> &times)
+{
+    Result result;
+    result.benchmark = benchmark;
+    result.size = size;
+    result.samples = samples;
+    result.best = *std::min_element(times.begin(), times.end());
+    result.mean = 0;
+    for (size_t t = 0; t < times.size(); ++t) result.mean += times[t];
+    result.mean /= times.size();
+    result.gflops = result.gbps = result.msps = 0;
+    return result;
+}
+
+static void Print(const Result &r)
+{
+    printf("%-12s %5u^2 %4u samples: %10.3fms (mean %10.3fms)",
+           r.benchmark.c_str(), (unsigned)r.size, (unsigned)r.samples,
+           r.best * 1e3, r.mean * 1e3);
+    if (r.gflops > 0) printf(" %8.2f GFLOP/s", r.gflops);
+    if (r.gbps > 0) printf(" %8.2f GB/s", r.gbps);
+    if (r.msps > 0) printf(" %10.2f Msamples/s", r.msps);
+    printf("\n");
+}
+
+/* A plain hexagonal iris, as a typical input for the FFT. */
+static ProceduralAperture Iris()
+{
+    ProceduralAperture shape;
+    shape.blades = 6; shape.radius = 0.1f; shape.rotation = 0;
+    shape.roundness = 0; shape.obstruction = 0; shape.vanes = 0;
+    shape.vaneWidth = 0; shape.dust = 0; shape.dustSize = 0.01f;
+    shape.seed = 0; shape.supersampling = 1;
+    return shape;
+}
+
+void Setup(cl::Context context, cl::CommandQueue queue, cl::Program program,
+           size_t dim_x, size_t dim_y, Pipeline &p, size_t tiles, bool half,
+           bool wide)
+{
+    p.dim_x = dim_x; p.dim_y = dim_y; p.tiles = tiles;
+    size_t rad_x = radix(dim_x), rad_y = radix(dim_y);
+    CLParams params = { (cl_uint)dim_x, (cl_uint)rad_x,
+                        (cl_uint)dim_y, (cl_uint)rad_y };
+    CLParams window = { 0, (cl_uint)rad_x, 0, (cl_uint)rad_y };
+    p.window = window;
+
+    std::vector<uint32_t> reversal_x(dim_x), reversal_y(dim_y);
+    ReversalTable(dim_x, rad_x, &reversal_x[0]);
+    ReversalTable(dim_y, rad_y, &reversal_y[0]);
+
+    cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR;
+    p.brtx = cl::Buffer(context, flags, sizeof(uint32_t) * dim_x,
+                        &reversal_x[0]);
+    p.brty = cl::Buffer(context, flags, sizeof(uint32_t) * dim_y,
+                        &reversal_y[0]);
+    size_t element = wide ? sizeof(cl_double4) : sizeof(cl_float4);
+    p.data = cl::Buffer(context, CL_MEM_READ_WRITE,
+                        dim_x * dim_y * element * tiles);
+    size_t pixel = half ? 4 * sizeof(cl_half) : sizeof(cl_float4);
+    p.render = cl::Buffer(context, CL_MEM_READ_WRITE,
+                          dim_x * dim_y * pixel * tiles);
+
+    cl::ImageFormat format(CL_INTENSITY, half ? CL_HALF_FLOAT : CL_FLOAT);
+    p.fraunhofer = cl::Image2D(context, CL_MEM_READ_WRITE, format,
+                               dim_x, tiles * (dim_y + 1) - 1, 0);
+
+    {
+        cl::ImageFormat format(CL_RGBA, CL_FLOAT);
+        p.spectrum = cl::Image2D(context, CL_MEM_READ_ONLY, format,
+                                 Resolution(), 1, 0);
+
+        cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+        cl::size_t<3> rgn; rgn[0] = Resolution(); rgn[1] = 1; rgn[2] = 1;
+        queue.enqueueWriteImage(p.spectrum, CL_TRUE, origin, rgn,
+                                0, 0, Curve());
+    }
+
+    ProceduralAperture shape = Iris();
+
+    p.generator = cl::Kernel(program, "cl_aperture");
+    p.generator.setArg(0, p.data);
+    p.generator.setArg(1, sizeof(params), &params);
+    p.generator.setArg(2, sizeof(shape), &shape);
+
+    cl_float lensDistance = 0.005f, gain = 1;
+    p.row = cl::Kernel(program, "cl_fft_row");
+    p.row.setArg(0, p.data);
+    p.row.setArg(1, sizeof(params), &params);
+    p.row.setArg(2, p.brtx);
+    p.row.setArg(3, sizeof(window), &window);
+
+    p.col = cl::Kernel(program, "cl_fft_col");
+    p.col.setArg(0, p.data);
+    p.col.setArg(1, sizeof(params), &params);
+    p.col.setArg(2, p.brty);
+    p.col.setArg(3, sizeof(window), &window);
+    p.col.setArg(4, p.fraunhofer);
+    p.col.setArg(5, sizeof(cl_float), &lensDistance);
+    p.col.setArg(6, sizeof(cl_float), &gain);
+
+    cl_uint prior = 0, bands = 0, scaled = 0;
+    uint64_t seed = 0;
+    p.lens = cl::Kernel(program, "cl_lens");
+    p.lens.setArg(0, p.render);
+    p.lens.setArg(1, sizeof(params), &params);
+    p.lens.setArg(2, p.fraunhofer);
+    p.lens.setArg(3, p.spectrum);
+    p.lens.setArg(5, sizeof(uint64_t), &seed);
+    p.lens.setArg(6, sizeof(cl_uint), &prior);
+    p.lens.setArg(7, sizeof(cl_uint), &bands);
+    p.lens.setArg(8, sizeof(cl_uint), &scaled);
+}
+
+/* Restricts the FFT to the window of the iris, as in a render. */
+static void Prune(Pipeline &p, bool stockham)
+{
+    CLParams params = { (cl_uint)p.dim_x, (cl_uint)radix(p.dim_x),
+                        (cl_uint)p.dim_y, (cl_uint)radix(p.dim_y) };
+    Bounds bounds = ProceduralBounds(Iris(), p.dim_x, p.dim_y);
+    p.window = PruneWindow(bounds, params, stockham);
+    p.row.setArg(3, sizeof(p.window), &p.window);
+    p.col.setArg(3, sizeof(p.window), &p.window);
+}
+
+double RunTransform(cl::CommandQueue queue, Pipeline &p)
+{
+    cl::NDRange offset(0), global_y(p.dim_x * p.tiles);
+    cl::NDRange global_x(((size_t)1 << p.window.rad_y) * p.tiles);
+    cl::Event row, col;
+
+    queue.enqueueNDRangeKernel(p.row, offset, global_x, cl::NullRange,
+                               0, &row);
+    queue.enqueueNDRangeKernel(p.col, offset, global_y, cl::NullRange,
+                               0, &col);
+    queue.finish();
+
+    return Elapsed(row) + Elapsed(col);
+}
+
+/* Regenerates the aperture (untimed), then runs both FFT passes. */
+static double RunFFT(cl::CommandQueue queue, Pipeline &p)
+{
+    cl::NDRange offset(0), global_xy(p.dim_x * p.dim_y * p.tiles);
+    queue.enqueueNDRangeKernel(p.generator, offset, global_xy, cl::NullRange);
+    return RunTransform(queue, p);
+}
+
+double RunLens(cl::CommandQueue queue, Pipeline &p, cl_uint samples)
+{
+    cl::NDRange offset(0), global((p.dim_x / 2 + 1) * (p.dim_y + 1));
+    cl::Event lens;
+
+    p.lens.setArg(4, sizeof(cl_uint), &samples);
+    queue.enqueueNDRangeKernel(p.lens, offset, global, cl::NullRange,
+                               0, &lens);
+    queue.finish();
+
+    return Elapsed(lens);
+}
+
+/* Times are per aperture, so that batches compare with single transforms. */
+static Result BenchFFT(cl::CommandQueue queue, Pipeline &p,
+                       const std::string &benchmark)
+{
+    std::vector<double> times;
+    for (size_t t = 0; t < WARMUP + REPETITIONS; ++t)
+    {
+        double time = RunFFT(queue, p) / p.tiles;
+        if (t >= WARMUP) times.push_back(time);
+    }
+
+    /* The usual 5 n log2(n) flops of a complex FFT of n = dim^2 points, and
+     * the minimal traffic of each pass reading and writing every complex
+     * value once, plus writing the (float) Fraunhofer image. */
+    double n = (double)p.dim_x * p.dim_y;
+    Result result = Summarize(benchmark, p.dim_x, 0, times);
+    result.gflops = 5 * n * log(n) / log(2.0) / result.best * 1e-9;
+    result.gbps = (2 * 2 * sizeof(cl_float2) + sizeof(cl_float)) * n
+                / result.best * 1e-9;
+    return result;
+}
+
+static Result BenchLens(cl::CommandQueue queue, Pipeline &p, size_t samples)
+{
+    RunFFT(queue, p);
+
+    std::vector<double> times;
+    for (size_t t = 0; t < WARMUP + REPETITIONS; ++t)
+    {
+        double time = RunLens(queue, p, samples);
+        if (t >= WARMUP) times.push_back(time);
+    }
+
+    double n = (double)p.dim_x * p.dim_y;
+    Result result = Summarize("lens", p.dim_x, samples, times);
+    result.msps = n * samples / result.best * 1e-6;
+    return result;
+}
+
+/* Parses an 8-bit raw PPM (held in memory, so that disk speed is excluded). */
+static Result BenchPPM(size_t dim)
+{
+    std::ostringstream ppm;
+    ppm << "P6\n" << dim << " " << dim << "\n255\n";
+    std::string pixels(dim * dim * 3, '\0');
+    for (size_t t = 0; t < pixels.size(); ++t) pixels[t] = (char)(t * 7);
+    std::string file = ppm.str() + pixels;
+
+    std::vector<cl_float4> aperture(dim * dim);
+    std::vector<double> times;
+
+    for (size_t t = 0; t < WARMUP + REPETITIONS; ++t)
+    {
+        double start = Seconds();
+        std::istringstream stream(file);
+        PPMHeader header;
+        ReadHeader(stream, header);
+        ReadAperture(stream, header, 1.0f, &aperture[0], dim, 0);
+        if (t >= WARMUP) times.push_back(Seconds() - start);
+    }
+
+    Result result = Summarize("ppm", dim, 0, times);
+    result.gbps = file.size() / result.best * 1e-9;
+    result.msps = (double)dim * dim / result.best * 1e-6;
+    return result;
+}
+
+/* Encodes float4 pixels (as read back from a render) to a temporary file. */
+static Result BenchRGBE(size_t dim)
+{
+    std::vector<cl_float4> pixels(dim * dim);
+    for (size_t t = 0; t < pixels.size(); ++t)
+    {
+        float v = (float)(t % 1021) / 1021;
+        pixels[t].s[0] = v; pixels[t].s[1] = v * v;
+        pixels[t].s[2] = 1 - v; pixels[t].s[3] = 1;
+    }
+
+    const char *path = "bench.hdr";
+    std::vector<double> times;
+
+    for (size_t t = 0; t < WARMUP + REPETITIONS; ++t)
+    {
+        double start = Seconds();
+        WriteRadiance(path, &pixels[0], dim, dim, false, 1);
+        if (t >= WARMUP) times.push_back(Seconds() - start);
+    }
+
+    remove(path);
+
+    Result result = Summarize("rgbe", dim, 0, times);
+    result.gbps = pixels.size() * sizeof(cl_float4) / result.best * 1e-9;
+    result.msps = (double)dim * dim / result.best * 1e-6;
+    return result;
+}
+
+/* A plain iterative radix-2 FFT of n points spaced by stride, with twiddles
+ * w (of n / 2 entries), as the CPU FFT would be written without codelets. */
+static void Loop(float *re, float *im, size_t n, size_t stride,
+                 const std::vector<float> &wr, const std::vector<float> &wi)
+{
+    for (size_t i = 1, j = 0; i < n; ++i)
+    {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+
+        if (i < j)
+        {
+            std::swap(re[i * stride], re[j * stride]);
+            std::swap(im[i * stride], im[j * stride]);
+        }
+    }
+
+    for (size_t len = 2; len <= n; len *= 2)
+        for (size_t i = 0; i < n; i += len)
+            for (size_t k = 0; k < len / 2; ++k)
+            {
+                size_t a = (i + k) * stride, b = a + len / 2 * stride;
+                float c = wr[k * (n / len)], s = wi[k * (n / len)];
+                float tr = re[b] * c - im[b] * s, ti = re[b] * s + im[b] * c;
+                re[b] = re[a] - tr; im[b] = im[a] - ti;
+                re[a] += tr; im[a] += ti;
+            }
+}
+
+/* Transforms the iris on the CPU, either with the plain loop ("cpu_loop") or
+ * with the codelets (see cpufft.hpp), over all rows then all columns, which
+ * are transformed in place ("cpu_fft") or in six steps ("cpu_six_step"). The
+ * planes are allocated and filled as by CpuFraunhofer, so that their pages
+ * are placed the same way. */
+static Result BenchCPU(size_t dim, bool loop, CpuMethod method = CPU_COLUMNS)
+{
+    size_t bytes = 2 * dim * dim * sizeof(float);
+    float *re = (float*)CpuAllocate(bytes), *im = re + dim * dim;
+    std::vector<float> wr(dim / 2), wi(dim / 2);
+    for (size_t k = 0; k < dim / 2; ++k)
+    {
+        wr[k] = (float)cos(-2 * M_PI * k / dim);
+        wi[k] = (float)sin(-2 * M_PI * k / dim);
+    }
+
+    std::vector<double> times;
+    for (size_t t = 0; t < WARMUP + REPETITIONS; ++t)
+    {
+        #pragma omp parallel for schedule(static)
+        for (long r = 0; r < (long)dim; ++r)
+            for (size_t i = r * dim; i < (r + 1) * dim; ++i)
+            {
+                double x = (double)(i % dim) / dim - 0.5;
+                double y = (double)(i / dim) / dim - 0.5;
+                re[i] = (x * x + y * y < 0.01); im[i] = 0;
+            }
+
+        double start = Seconds();
+        if (!loop) CpuTransform(re, im, dim, dim, method);
+        else
+        {
+            for (size_t y = 0; y < dim; ++y)
+                Loop(&re[y * dim], &im[y * dim], dim, 1, wr, wi);
+            for (size_t x = 0; x < dim; ++x)
+                Loop(&re[x], &im[x], dim, dim, wr, wi);
+        }
+
+        if (t >= WARMUP) times.push_back(Seconds() - start);
+    }
+
+    CpuFree(re, bytes);
+
+    double n = (double)dim * dim;
+    const char *name = (method == CPU_SIX_STEP) ? "cpu_six_step" : "cpu_fft";
+    Result result = Summarize(loop ? "cpu_loop" : name, dim, 0, times);
+    result.gflops = 5 * n * log(n) / log(2.0) / result.best * 1e-9;
+    return result;
+}
+
+static void WriteResults(const char *path, cl::Platform platform,
+                         cl::Device device, const std::vector<Result> &results)
+{
+    std::string platformName, deviceName, driver;
+    platform.getInfo(CL_PLATFORM_NAME, &platformName);
+    device.getInfo(CL_DEVICE_NAME, &deviceName);
+    device.getInfo(CL_DRIVER_VERSION, &driver);
+
+    std::fstream out(path, std::ios::out);
+    out << "{" << std::endl;
+    out << "  \"platform\": \"" << platformName << "\"," << std::endl;
+    out << "  \"device\": \"" << deviceName << "\"," << std::endl;
+    out << "  \"driver\": \"" << driver << "\"," << std::endl;
+    out << "  \"warmup\": " << WARMUP << "," << std::endl;
+    out << "  \"repetitions\": " << REPETITIONS << "," << std::endl;
+    out << "  \"results\": [" << std::endl;
+
+    for (size_t t = 0; t < results.size(); ++t)
+    {
+        const Result &r = results[t];
+        char line[512];
+        sprintf(line, "    {\"benchmark\": \"%s\", \"size\": %u, "
+                "\"samples\": %u, \"best\": %.9f, \"mean\": %.9f, "
+                "\"gflops\": %.4f, \"gbps\": %.4f, \"msamples\": %.4f}%s",
+                r.benchmark.c_str(), (unsigned)r.size, (unsigned)r.samples,
+                r.best, r.mean, r.gflops, r.gbps, r.msps,
+                (t + 1 < results.size()) ? "," : "");
+        out << line << std::endl;
+    }
+
+    out << "  ]" << std::endl << "}" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    bool accuracy = (argc > 1) && (std::string(argv[1]) == "--accuracy");
+    const char *path = (argc > 1 + accuracy) ? argv[1 + accuracy] : 0;
+    size_t pla_num, dev_num;
+    bool cpuPin;
+    std::string hugePages;
+
+    {
+        std::fstream xml("config.xml", std::ios::in);
+        pugi::xml_document doc; doc.load(xml);
+
+        pugi::xml_node node = doc.child("Settings");
+        pla_num = node.child("OpenCL").attribute("Platform").as_uint();
+        dev_num = node.child("OpenCL").attribute("Device").as_uint();
+        cpuPin  = node.child("CPU").attribute("Pin").as_bool(true);
+        hugePages = node.child("CPU").attribute("HugePages")
+                                     .as_string("Transparent");
+    }
+
+    cl::Platform platform;
+    cl::Device     device;
+
+    {
+        std::vector<cl::Platform> platforms; cl::Platform::get(&platforms);
+        if (pla_num >= platforms.size()) return 0;
+        platform = platforms[pla_num];
+
+        std::vector<cl::Device> devices;
+        platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        if (dev_num >= devices.size()) return 0;
+        device = devices[dev_num];
+    }
+
+    std::vector<cl::Device> devices(&device, &device + 1);
+    cl::Context context(devices, 0, 0, 0, 0);
+    cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+    cl::Program program = LoadProgram(context, devices, "");
+    cl::Program stockham = LoadProgram(context, devices, "-D STOCKHAM ");
+
+    if (accuracy)
+        return Accuracy(context, queue, program, stockham, path) ? 0 : 1;
+
+    CpuSetup(cpuPin, hugePages);
+
+    cl_ulong maxAlloc = 0;
+    size_t maxImage = 0, maxHeight = 0;
+    device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxAlloc);
+    device.getInfo(CL_DEVICE_IMAGE2D_MAX_WIDTH, &maxImage);
+    device.getInfo(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &maxHeight);
+
+    std::vector<Result> results;
+    size_t count = sizeof(sizes) / sizeof(*sizes);
+
+    for (size_t s = 0; s < count; ++s)
+    {
+        size_t dim = sizes[s];
+
+        if ((dim * dim * sizeof(cl_float4) > maxAlloc) || (dim > maxImage))
+            std::cout << "Skipping " << dim << "^2 on the device" << std::endl;
+        else
+        {
+            Pipeline pipeline;
+            Setup(context, queue, program, dim, dim, pipeline);
+
+            results.push_back(BenchFFT(queue, pipeline, "fft"));
+            Print(results.back());
+
+            {
+                Pipeline pipeline;
+                Setup(context, queue, stockham, dim, dim, pipeline);
+                results.push_back(BenchFFT(queue, pipeline, "fft_stockham"));
+                Print(results.back());
+            }
+
+            Prune(pipeline, false);
+            results.push_back(BenchFFT(queue, pipeline, "fft_pruned"));
+            Print(results.back());
+
+            size_t bytes = dim * dim * sizeof(cl_float4);
+            size_t tiles = std::min((size_t)BATCH_TILES,
+                                    (size_t)(maxAlloc / bytes));
+            tiles = std::min(tiles, (maxHeight + 1) / (dim + 1));
+
+            if ((dim <= BATCH_SIZE) && (tiles > 1))
+            {
+                Pipeline pipeline;
+                Setup(context, queue, program, dim, dim, pipeline, tiles);
+                results.push_back(BenchFFT(queue, pipeline, "fft_batch"));
+                Print(results.back());
+            }
+
+            for (size_t t = 0; t < sizeof(sampleCounts) / sizeof(size_t); ++t)
+            {
+                results.push_back(BenchLens(queue, pipeline, sampleCounts[t]));
+                Print(results.back());
+            }
+        }
+
+        if (dim <= CPU_LOOP_SIZE)
+        {
+            results.push_back(BenchCPU(dim, true)); Print(results.back());
+        }
+
+        if (dim <= CPU_SIZE)
+        {
+            results.push_back(BenchCPU(dim, false)); Print(results.back());
+            results.push_back(BenchCPU(dim, false, CPU_SIX_STEP));
+            Print(results.back());
+        }
+
+        results.push_back(BenchPPM(dim)); Print(results.back());
+        results.push_back(BenchRGBE(dim)); Print(results.back());
+    }
+
+    if (path) WriteResults(path, platform, device, results);
+}
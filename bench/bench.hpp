@@ -0,0 +1,42 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <utility.hpp>
+
+/* Everything needed to run the FFT and lens kernels at one size, with the
+ * same arguments as in a render (no symmetry), over a batch of the given
+ * number of tiles. Storage is float unless half, which needs a program built
+ * with HALF_STORAGE, and the FFT buffer holds float4 unless wide (double4,
+ * for a program built with DOUBLE_FFT). The FFT window is the whole aperture
+ * unless it is pruned. */
+struct Pipeline
+{
+    size_t dim_x, dim_y, tiles;
+    CLParams window;
+    cl::Buffer brtx, brty, data, render;
+    cl::Image2D fraunhofer, spectrum;
+    cl::Kernel generator, row, col, lens;
+};
+
+void Setup(cl::Context context, cl::CommandQueue queue, cl::Program program,
+           size_t dim_x, size_t dim_y, Pipeline &p, size_t tiles = 1,
+           bool half = false, bool wide = false);
+
+/* Runs both FFT passes over the data buffer, returning their device time. */
+double RunTransform(cl::CommandQueue queue, Pipeline &p);
+
+/* Runs the lens over the Fraunhofer image with the given number of samples
+ * per pixel, returning its device time. */
+double RunLens(cl::CommandQueue queue, Pipeline &p, cl_uint samples);
+
+/* Returns the time taken by a completed command, in seconds. */
+double Elapsed(const cl::Event &event);
+
+/* Checks the FFT, whole and pruned, against a reference DFT, printing the
+ * error for each input and size (and saving them as JSON to path, if not
+ * null), for both programs (the second built with STOCKHAM) and, if the
+ * device supports it, both in double precision, then checks the out-of-core
+ * FFT, the chirp-z transform, the pupils, the CPU FFT, the wedge of the lens
+ * and half storage. Returns whether every error is within tolerance. */
+bool Accuracy(cl::Context context, cl::CommandQueue queue, cl::Program program,
+              cl::Program stockham, const char *path);
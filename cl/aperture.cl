@@ -0,0 +1,140 @@
+/* Procedural aperture parameters (see ProceduralAperture in aperture.hpp). */
+typedef struct Procedural
+{
+    uint blades;
+    float radius, rotation, roundness, obstruction;
+    uint vanes;
+    float vaneWidth, dust, dustSize;
+    uint seed, supersampling;
+} Procedural;
+
+/* Returns the radius of the iris edge in the direction theta. The blades form
+ * a regular polygon, which is blended towards its circumcircle as they round
+ * off. Fewer than three blades give a plain circular aperture. */
+float edge(Procedural p, float theta)
+{
+    if (p.blades < 3) return p.radius;
+
+    float sector = 2 * PI / p.blades;
+    float a = theta - RADIAN(p.rotation);
+    a -= sector * floor(a / sector);
+
+    float polygon = p.radius * cos(PI / p.blades) / cos(a - sector / 2);
+    return mix(polygon, p.radius, p.roundness);
+}
+
+/* Returns whether the point q is covered by a dust speck. The plane is tiled
+ * into cells, each holding at most one speck placed by a PRNG keyed on that
+ * cell, so that specks are found in constant time and never straddle cells. */
+bool speck(Procedural p, float2 q)
+{
+    float size = p.dustSize * p.radius, cell = 4 * size;
+    float2 c = floor(q / cell);
+
+    ulong id = ((ulong)(uint)(int)c.x << 32) | (uint)(int)c.y;
+    PRNG prng = init(id, p.seed);
+
+    /* A speck of radius uniform in [0.5, 1] size has a mean area of 7/12 of
+     * the largest, pi size^2, and its cell is 16 size^2, so a speck in each
+     * cell would cover 7 pi / 192 (about 11%) of the plane, which is as far
+     * as dust goes (MAX_DUST in aperture.hpp). */
+    if (rand(&prng) >= p.dust * 192 / (7 * PI)) return false;
+
+    float r = size * (0.5f + 0.5f * rand(&prng));
+    float2 center = (float2)(rand(&prng), rand(&prng)) * (cell - 2 * r) + r;
+    return distance(q, c * cell + center) < r;
+}
+
+/* Returns the transmission (0 or 1) of the aperture at the point q. */
+float transmission(Procedural p, float2 q)
+{
+    float r = length(q), theta = atan2(q.y, q.x);
+    if ((r > edge(p, theta)) || (r < p.obstruction * p.radius)) return 0;
+
+    for (uint t = 0; t < p.vanes; ++t)
+    {
+        float angle = RADIAN(p.rotation) + t * 2 * PI / p.vanes;
+        float2 dir = (float2)(cos(angle), sin(angle));
+
+        if ((dot(q, dir) > 0) && (fabs(q.x * dir.y - q.y * dir.x)
+                                  < p.vaneWidth * p.radius / 2)) return 0;
+    }
+
+    return ((p.dust > 0) && speck(p, q)) ? 0 : 1;
+}
+
+/* Rasterizes the aperture straight into the FFT input buffer, averaging the
+ * transmission over a stratified grid of subsamples for each pixel. A global
+ * offset generates only a block of rows, into a buffer holding that block,
+ * and a larger range generates the same aperture in each tile of a batch. */
+void kernel cl_aperture(global real4 *v, private Params dims,
+                        private Procedural p)
+{
+    size_t index = get_global_id(0);
+    size_t px = index % dims.x, py = (index / dims.x) % dims.y;
+    uint n = max(p.supersampling, 1u);
+
+    float sum = 0;
+    for (uint j = 0; j < n; ++j)
+        for (uint i = 0; i < n; ++i)
+        {
+            float2 q = (float2)(px + (i + 0.5f) / n - dims.x / 2,
+                                py + (j + 0.5f) / n - dims.y / 2);
+            sum += transmission(p, q / dims.x);
+        }
+
+    v[index - get_global_offset(0)] = (real4)(sum / (n * n), 0, 0, 0);
+}
+
+/* Phase aberrations (see Aberration in aperture.hpp). */
+typedef struct Aberration
+{
+    float radius, defocus;
+    float astigmatismX, astigmatismY;
+    float comaX, comaY;
+    float spherical;
+} Aberration;
+
+/* Returns the optical path difference of the Zernike terms at q (relative to
+ * the pupil radius). */
+float zernike(Aberration a, float2 q)
+{
+    float r2 = dot(q, q), r = sqrt(r2), theta = atan2(q.y, q.x);
+
+    return a.defocus * sqrt(3.0f) * (2 * r2 - 1)
+         + a.astigmatismX * sqrt(6.0f) * r2 * cos(2 * theta)
+         + a.astigmatismY * sqrt(6.0f) * r2 * sin(2 * theta)
+         + a.comaX * sqrt(8.0f) * (3 * r2 - 2) * r * cos(theta)
+         + a.comaY * sqrt(8.0f) * (3 * r2 - 2) * r * sin(theta)
+         + a.spherical * sqrt(5.0f) * (6 * r2 * r2 - 6 * r2 + 1);
+}
+
+/* Turns the amplitude of the aperture (in the first tile) into the complex
+ * pupil of each wavelength band, one per tile, with the phase of its optical
+ * path difference (the map plus the Zernike terms) at the band's center, so
+ * that all bands are transformed in one launch. Each work-item does a pixel
+ * of every tile, so that the amplitude is read before it is overwritten. */
+void kernel cl_pupil(global real4 *v, private Params dims,
+                     global const float *map, private Aberration a,
+                     private uint bands)
+{
+    size_t index = get_global_id(0);
+    size_t px = index % dims.x, py = index / dims.x;
+    float2 q = (float2)((float)px - dims.x / 2, (float)py - dims.y / 2);
+
+    real amplitude = v[index].x;
+    float opd = map[index] + zernike(a, q / (a.radius * dims.x));
+
+    for (uint b = 0; b < bands; ++b)
+    {
+        real phase = TAU * opd / BAND(b, bands);
+#ifdef FRESNEL
+        /* The rows add the Fresnel chirp at LAMBDA (see fft.cl), so only
+         * the difference from it at the center of the band is added here. */
+        phase += FRESNEL * dot(q, q) * (LAMBDA / BAND(b, bands) - 1);
+#endif
+        v[b * dims.x * dims.y + index] = (real4)(amplitude * cos(phase),
+                                                 amplitude * sin(phase),
+                                                 0, 0);
+    }
+}
@@ -0,0 +1,140 @@
+/* Chirp-z transform: rather than rescaling the one Fraunhofer image computed
+ * at LAMBDA for every wavelength, the spectrum can be evaluated directly at
+ * the scale of each of a few bands of wavelengths, that is at frequencies of
+ * s (k - n/2) / n for k < n where s = BAND(b, bands) / LAMBDA, with
+ * Bluestein's algorithm: writing nk = (n^2 + k^2 - (k - n)^2) / 2 turns the
+ * transform into a convolution with a chirp, done with FFTs of m = 2n
+ * elements. The chirps, and the FFT of the one convolved with, are computed
+ * by the host for every band and axis (see chirp.hpp): each table holds n
+ * premultipliers, n postmultipliers and the m element filter. Each work-item
+ * needs m elements of scratch space, where the FFTs are done. The rows go
+ * from xy to zw, and the columns from zw straight to the image of the band,
+ * so the aperture (in xy) is kept for the next band. The frequencies always
+ * span the whole image about its center; zooming into a region of it would
+ * only take an offset in the tables, but nothing needs it yet. */
+
+/* Complex product. */
+real2 cmul(real2 a, real2 b)
+{
+    return (real2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+/* Transforms n elements at base + j * stride, of which only the 2^w at offset
+ * (given by the window) can be nonzero, reading them from the given slot. The
+ * result is left in the scratch space, in the returned slot, to be read with
+ * chirp_result. With FRESNEL, the rows multiply their input by the Fresnel
+ * chirp at the given rate, y being their offset from the center. */
+bool bluestein(global real4 *v, size_t base, size_t stride, size_t n,
+               size_t offset, size_t w, bool in,
+               global real4 *scratch, global const real2 *table,
+               real rate, real y)
+{
+    size_t m = 2 * n, stages = 1;
+    while (((size_t)1 << stages) < m) ++stages;
+    global const real2 *pre = table, *filter = table + 2 * n;
+
+    for (size_t t = 0; t < m; ++t) scratch[t] = (real4)(0, 0, 0, 0);
+
+    for (size_t t = offset; t < offset + ((size_t)1 << w); ++t)
+    {
+        real2 a = get_slot(v, base + t * stride, in);
+        if (rate != 0)
+        {
+            real x = (real)t - n / 2;
+            real phase = rate * (x * x + y * y);
+            a = cmul(a, (real2)(cos(phase), sin(phase)));
+        }
+
+        scratch[t].xy = cmul(a, pre[t]);
+    }
+
+    /* The inverse FFT is done as the conjugate of the forward FFT of the
+     * conjugate (see chirp_result). */
+    stockham(scratch, 0, 1, m, stages, false, 0, 0);
+    bool slot = (stages & 1) != 0;
+
+    for (size_t t = 0; t < m; ++t)
+    {
+        real2 a = cmul(get_slot(scratch, t, slot), filter[t]);
+        set_slot(scratch, t, slot, (real2)(a.x, -a.y));
+    }
+
+    stockham(scratch, 0, 1, m, stages, slot, 0, 0);
+    return (stages & 1) ? !slot : slot;
+}
+
+/* Returns element k of the transform left in scratch by bluestein. */
+real2 chirp_result(global real4 *scratch, size_t k, bool slot, size_t n,
+                   global const real2 *table)
+{
+    real2 a = get_slot(scratch, k, slot) / (2 * n);
+    return cmul((real2)(a.x, -a.y), table[n + k]);
+}
+
+/* Rows of the window, as for cl_fft_row, each with its own scratch space. */
+void kernel cl_chirp_row(global real4 *v, private Params dims,
+                         private Params window, global real4 *scratch,
+                         global const real2 *table,
+                         private uint band, private uint bands)
+{
+    size_t span = 1 << window.ry;
+    size_t index = get_global_id(0);
+    size_t row = (index / span) * dims.y + window.y + index % span;
+
+    /* The Fresnel chirp (see fft.cl) at the center of the band. */
+    real rate = 0;
+#ifdef FRESNEL
+    rate = FRESNEL * LAMBDA / BAND(band, bands);
+#endif
+
+    scratch += index * 2 * dims.x;
+    table += band * 4 * dims.x;
+    bool slot = bluestein(v, row * dims.x, 1, dims.x, window.x, window.rx,
+                          false, scratch, table, rate,
+                          (real)(row % dims.y) - dims.y / 2);
+
+    for (size_t k = 0; k < dims.x; ++k)
+        v[row * dims.x + k].zw = chirp_result(scratch, k, slot, dims.x, table);
+}
+
+/* Columns of every tile of a batch, as for cl_fft_col, with the image of the
+ * band written to tile * bands + band of the atlas (see fetch in lens.cl).
+ * Frequencies beyond the Nyquist limit (which the FFT never reaches, but the
+ * red bands do) alias, so they are cleared instead. */
+void kernel cl_chirp_col(global real4 *v, private Params dims,
+                         private Params window, global real4 *scratch,
+                         global const real2 *table,
+                         write_only image2d_t fraunhofer,
+                         private uint band, private uint bands,
+                         private float lensDistance,
+                         private float gain)
+{
+    size_t tile = get_global_id(0) / dims.x;
+    size_t col = get_global_id(0) % dims.x;
+    v += tile * dims.x * dims.y;
+
+    scratch += get_global_id(0) * 2 * dims.y;
+    table += band * 4 * dims.y;
+    bool slot = bluestein(v, col, dims.x, dims.y, window.y, window.ry,
+                          true, scratch, table, 0, 0);
+
+    real norm = (real)dims.x * dims.y;
+    real scale = gain / (pow((real)(LAMBDA * lensDistance), 2) * norm * norm);
+    float s = BAND(band, bands) / LAMBDA;
+    float fx = s * ((float)col / dims.x - 0.5f);
+    size_t y = (tile * bands + band) * (dims.y + 1);
+
+    for (size_t t = 0; t < dims.y; ++t)
+    {
+        real2 A = chirp_result(scratch, t, slot, dims.y, table);
+        float fy = s * ((float)t / dims.y - 0.5f);
+        float intensity = (float)((A.x * A.x + A.y * A.y) * scale);
+        if ((fabs(fx) > 0.5f) || (fabs(fy) > 0.5f)) intensity = 0;
+        write_imagef(fraunhofer, (int2)(col, y + t),
+                     (float4)ENCODE(intensity));
+    }
+
+    int gutter = y + dims.y;
+    if (gutter < get_image_height(fraunhofer))
+        write_imagef(fraunhofer, (int2)(col, gutter), (float4)0);
+}
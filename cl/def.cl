@@ -1,7 +1,12 @@
 #include <prng.cl>
 
-/* Ref. wavelength.. */
-#define LAMBDA (575.0f)
+/* Ref. wavelength, in nm, defined by LoadProgram (see utility.hpp). */
+#ifndef LAMBDA
+#error LAMBDA must be defined when building the kernels
+#endif
+
+/* Wavelength at the center of band b of n (390nm to 790nm, as in sample). */
+#define BAND(b, n) (390 + 400 * ((b) + 0.5f) / (n))
 
 #define PI 3.14159265f
 
@@ -9,10 +14,41 @@
 
 typedef struct Params { int x, rx, y, ry; } Params;
 
+/* FFT buffer precision: with DOUBLE_FFT the transform is done in double
+ * precision (which requires cl_khr_fp64), only the image is in float. */
+#ifdef DOUBLE_FFT
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double2 real2;
+typedef double4 real4;
+#define TAU 6.283185307179586
+#else
+typedef float real;
+typedef float2 real2;
+typedef float4 real4;
+#define TAU (2 * PI)
+#endif
+
+/* Accumulation buffer layout (see cl_lens). With HALF_STORAGE, the image
+ * holds the square root of each intensity (see fetch in lens.cl), whose range
+ * fits that of half much better than the intensity does. */
+#ifdef HALF_STORAGE
+#define RENDER half
+#define ENCODE(intensity) sqrt(intensity)
+#else
+#define RENDER float4
+#define ENCODE(intensity) (intensity)
+#endif
+
 constant sampler_t sampler = CLK_NORMALIZED_COORDS_TRUE |
                              CLK_ADDRESS_CLAMP |
                              CLK_FILTER_LINEAR;
 
+/* For reading single texels, in pixel coordinates. */
+constant sampler_t texels = CLK_NORMALIZED_COORDS_FALSE |
+                            CLK_ADDRESS_CLAMP |
+                            CLK_FILTER_NEAREST;
+
 /* Colorization parameters. */
 #define RINGING 1.25f
 #define ROTATE 2.75f
@@ -1,82 +1,269 @@
-void kernel cl_fft_row(global float4 *v, private Params dims, constant uint *r)
+/* Each element of the buffer holds two complex values, in its xy and its zw
+ * slots. The Cooley-Tukey FFT scatters the aperture (in xy) to zw in bit
+ * reversed order using the host's tables and transforms the rows in place;
+ * the columns are scattered back to xy and transformed in place there. With
+ * STOCKHAM, a self-sorting Stockham FFT is used instead, which reads from one
+ * slot and writes to the other at each stage so that no permutation (and no
+ * table) is needed, and the result of each pass ends up in either slot based
+ * on the parity of its number of stages. */
+/* Pruning: the aperture is often a small shape in a large field of zeros, so
+ * each pass only reads a window of 2^w elements (given by a Params holding
+ * the offset and w of each axis) outside of which its input is known to be
+ * zero, and the rows outside of the window are not transformed at all. With
+ * n = 2^s elements in all, the first s - w stages of either FFT would only
+ * spread each input over a run of 2^(s - w) elements, so they are skipped
+ * by writing those runs directly. The window need not start at zero, which
+ * only changes the phase of the spectrum (never its power). */
+#ifdef STOCKHAM
+#define ROW_SLOT(dims) ((dims.rx & 1) != 0)
+#define COL_SLOT(dims) (ROW_SLOT(dims) != ((dims.ry & 1) != 0))
+#else
+#define ROW_SLOT(dims) true
+#define COL_SLOT(dims) false
+#endif
+
+/* Fresnel propagation: the near field is the far field of the aperture times
+ * a quadratic phase (a chirp), so the rows multiply their input by it as they
+ * load it, and the transform is otherwise the same. FRESNEL is the rate of
+ * the chirp, in radians per squared pixel from the center, at LAMBDA. The
+ * field is also multiplied by a chirp afterwards, which is left out as only
+ * its intensity is ever used. */
+#ifdef FRESNEL
+real2 fresnel(real2 a, real x, real y, Params dims)
+{
+    x -= dims.x / 2; y -= dims.y / 2;
+    real phase = FRESNEL * (x * x + y * y), c = cos(phase), s = sin(phase);
+    return (real2)(a.x * c - a.y * s, a.x * s + a.y * c);
+}
+#endif
+
+/* Reads or writes the zw slot of element i if hi is true, else xy. */
+real2 get_slot(global real4 *v, size_t i, bool hi)
+{
+    return hi ? v[i].zw : v[i].xy;
+}
+
+void set_slot(global real4 *v, size_t i, bool hi, real2 value)
+{
+    if (hi) v[i].zw = value;
+    else v[i].xy = value;
+}
+
+/* Radix-2 Stockham FFT of n elements, at base + j * stride, starting from the
+ * given slot. Each stage combines elements j and j + n/2 into 2j - k and
+ * 2j - k + p (k being j mod p), so the output is in natural order. The input
+ * is the window of n >> skip elements at offset; the runs written in place
+ * of the skipped stages go to the slot those stages would have left them in,
+ * so skip must be odd (or zero) for them not to overwrite the window. */
+void stockham(global real4 *v, size_t base, size_t stride, size_t n,
+              size_t stages, bool slot, size_t offset, size_t skip)
 {
-    size_t row = get_global_id(0);
-    for (size_t t = 0; t < dims.x; ++t)
-        v[row * dims.x + r[t]].zw = v[row * dims.x + t].xy;
+    for (size_t t = 0; (skip > 0) && (t < (n >> skip)); ++t)
+    {
+        real2 a = get_slot(v, base + (offset + t) * stride, slot);
+
+        for (size_t c = 0; c < ((size_t)1 << skip); ++c)
+            set_slot(v, base + ((t << skip) + c) * stride, !slot, a);
+    }
+
+    if (skip & 1) slot = !slot;
 
-    for (size_t i = 0; i < dims.rx; ++i)
+    for (size_t i = skip; i < stages; ++i, slot = !slot)
+    {
+        size_t p = 1 << i;
+        real arg = -(TAU / (2 * p));
+
+        for (size_t k = 0; k < p; ++k)
+        {
+            real2 twiddle = (real2)(cos(arg * k), sin(arg * k));
+
+            for (size_t j = k; j < n / 2; j += p)
+            {
+                real2 e = get_slot(v, base + j * stride, slot);
+                real2 q = get_slot(v, base + (j + n / 2) * stride, slot);
+
+                real2 o = (real2)(twiddle.x * q.x - twiddle.y * q.y,
+                                  twiddle.x * q.y + twiddle.y * q.x);
+
+                size_t d = (j - k) * 2 + k;
+                set_slot(v, base + d * stride, !slot, e + o);
+                set_slot(v, base + (d + p) * stride, !slot, e - o);
+            }
+        }
+    }
+}
+
+/* Only the 2^window.ry rows of the window are launched (for each tile of a
+ * batch, see cl_fft_col); the others are zero in both slots. */
+void kernel cl_fft_row(global real4 *v, private Params dims, constant uint *r,
+                       private Params window)
+{
+    size_t span = 1 << window.ry, skip = dims.rx - window.rx;
+    size_t index = get_global_id(0);
+    size_t row = (index / span) * dims.y + window.y + index % span;
+
+#ifdef STOCKHAM
+#ifdef FRESNEL
+    for (size_t t = window.x; t < window.x + (dims.x >> skip); ++t)
+        v[row * dims.x + t].xy = fresnel(v[row * dims.x + t].xy, t,
+                                         row % dims.y, dims);
+#endif
+    stockham(v, row * dims.x, 1, dims.x, dims.rx, false, window.x, skip);
+#else
+    /* The window is scattered to the bit reversed runs (r[t] + c). */
+    for (size_t t = 0; t < (dims.x >> skip); ++t)
+    {
+        real2 a = v[row * dims.x + window.x + t].xy;
+#ifdef FRESNEL
+        a = fresnel(a, window.x + t, row % dims.y, dims);
+#endif
+        for (size_t c = 0; c < ((size_t)1 << skip); ++c)
+            v[row * dims.x + r[t] + c].zw = a;
+    }
+
+    for (size_t i = skip; i < dims.rx; ++i)
     {
         size_t m = 1 << i, n = m * 2;
-        float arg = -(2 * PI / n);
+        real arg = -(TAU / n);
 
         for (size_t k = 0; k < m; ++k)
         {
-            float2 twiddle = (float2)(cos(arg * k), sin(arg * k));
+            real2 twiddle = (real2)(cos(arg * k), sin(arg * k));
 
             for (size_t j = k; j < dims.x; j += n)
             {
-                float2 e = v[row * dims.x + j].zw;
-                float2 q = v[row * dims.x + (j + m)].zw;
+                real2 e = v[row * dims.x + j].zw;
+                real2 q = v[row * dims.x + (j + m)].zw;
 
-                float2 o = (float2)(twiddle.x * q.x - twiddle.y * q.y,
-                                    twiddle.x * q.y + twiddle.y * q.x);
+                real2 o = (real2)(twiddle.x * q.x - twiddle.y * q.y,
+                                  twiddle.x * q.y + twiddle.y * q.x);
 
                 v[row * dims.x + j].zw       = e + o;
                 v[row * dims.x + (j + m)].zw = e - o;
             }
         }
     }
-
-    for (size_t t = 0; t < dims.x; ++t)
-        v[row * dims.x + t].zw /= dims.x;
+#endif
 }
 
-void kernel cl_fft_col(global float4 *v, private Params dims, constant uint *r)
+/* Transforms one column, from ROW_SLOT to COL_SLOT. */
+void fft_col(global real4 *v, Params dims, constant uint *r, Params window,
+             size_t col)
 {
-    size_t col = get_global_id(0);
-    for (size_t t = 0; t < dims.y; ++t)
-        v[r[t] * dims.x + col].xy = v[t * dims.x + col].zw;
+    size_t skip = dims.ry - window.ry;
 
-    for (size_t i = 0; i < dims.ry; ++i)
+#ifdef STOCKHAM
+    stockham(v, col, dims.x, dims.y, dims.ry, ROW_SLOT(dims), window.y, skip);
+#else
+    for (size_t t = 0; t < (dims.y >> skip); ++t)
+        for (size_t c = 0; c < ((size_t)1 << skip); ++c)
+            v[(r[t] + c) * dims.x + col].xy
+                = v[(window.y + t) * dims.x + col].zw;
+
+    for (size_t i = skip; i < dims.ry; ++i)
     {
         size_t m = 1 << i, n = m * 2;
-        float arg = -(2 * PI / n);
+        real arg = -(TAU / n);
 
         for (size_t k = 0; k < m; ++k)
         {
-            float2 twiddle = (float2)(cos(arg * k), sin(arg * k));
+            real2 twiddle = (real2)(cos(arg * k), sin(arg * k));
 
             for (size_t j = k; j < dims.y; j += n)
             {
-                float2 e = v[j * dims.x + col].xy;
-                float2 q = v[(j + m) * dims.x + col].xy;
+                real2 e = v[j * dims.x + col].xy;
+                real2 q = v[(j + m) * dims.x + col].xy;
 
-                float2 o = (float2)(twiddle.x * q.x - twiddle.y * q.y,
-                                    twiddle.x * q.y + twiddle.y * q.x);
+                real2 o = (real2)(twiddle.x * q.x - twiddle.y * q.y,
+                                  twiddle.x * q.y + twiddle.y * q.x);
 
                 v[j * dims.x + col].xy       = e + o;
                 v[(j + m) * dims.x + col].xy = e - o;
             }
         }
     }
+#endif
+}
+
+/* The column pass also produces the final Fraunhofer image: the 1/(xy) FFT
+ * normalization and the far-field factor are folded into a single constant,
+ * and each element is squared and written to its fftshifted pixel directly,
+ * so no further pass over the buffer is required. The intensity is computed
+ * at the precision of the transform and only then rounded to float.
+ *
+ * A batch of apertures of the same size is transformed in the same launches
+ * by stacking them in the buffer, one tile after the other: the rows of all
+ * tiles are then just more rows for cl_fft_row, and this kernel is launched
+ * over the columns of every tile. Their images are stacked in an atlas too,
+ * with a row of zeros after each one (see fetch in lens.cl), which is only
+ * written if the image is tall enough to hold another tile. */
+void kernel cl_fft_col(global real4 *v, private Params dims, constant uint *r,
+                       private Params window,
+                       write_only image2d_t fraunhofer,
+                       private float lensDistance,
+                       private float gain)
+{
+    size_t tile = get_global_id(0) / dims.x;
+    size_t col = get_global_id(0) % dims.x;
+    v += tile * dims.x * dims.y;
+    fft_col(v, dims, r, window, col);
+
+    real norm = (real)dims.x * dims.y;
+    real scale = gain / (pow((real)(LAMBDA * lensDistance), 2) * norm * norm);
+    size_t x = (col + dims.x / 2) % dims.x;
 
     for (size_t t = 0; t < dims.y; ++t)
-        v[t * dims.x + col].xy /= dims.y;
+    {
+        real2 A = get_slot(v, t * dims.x + col, COL_SLOT(dims));
+        float intensity = (float)((A.x * A.x + A.y * A.y) * scale);
+        int2 pixel = (int2)(x, (t + dims.y / 2) % dims.y);
+        pixel.y += tile * (dims.y + 1);
+        write_imagef(fraunhofer, pixel, (float4)ENCODE(intensity));
+    }
+
+    int gutter = (tile + 1) * (dims.y + 1) - 1;
+    if (gutter < get_image_height(fraunhofer))
+        write_imagef(fraunhofer, (int2)(x, gutter), (float4)0);
 }
 
-void kernel cl_fft_normalize(global float4 *v, private Params dims,
-                             write_only image2d_t fraunhofer,
-                             private float lensDistance)
+/* Column pass over a block of the columns of a larger aperture (see the
+ * out-of-core FFT), whose width is that of the block (but whose rx is that
+ * of the aperture, for ROW_SLOT); the image is written separately by
+ * cl_fft_power once the block has been transformed. */
+void kernel cl_fft_col_block(global real4 *v, private Params block,
+                             constant uint *r, private Params window)
 {
-    size_t pixel = get_global_id(0);
-    size_t x = pixel % dims.x;
-    size_t y = pixel / dims.x;
+    fft_col(v, block, r, window, get_global_id(0));
+}
 
-    size_t cx = (x + dims.x / 2) % dims.x; /* FFT ratios. */
-    size_t cy = (y + dims.y / 2) % dims.y * dims.x / dims.y;
+/* Writes the Fraunhofer image of a transformed block of columns, starting at
+ * column offset of an aperture of the given dims, decimated by factor in both
+ * directions: each pixel is the mean intensity of factor^2 elements (which is
+ * a power of two, like the dims, so that fftshift and decimation commute). */
+void kernel cl_fft_power(global real4 *v, private Params block,
+                         private Params dims,
+                         write_only image2d_t fraunhofer,
+                         private uint offset, private uint factor,
+                         private float lensDistance,
+                         private float gain)
+{
+    size_t index = get_global_id(0);
+    size_t bx = index % (block.x / factor), by = index / (block.x / factor);
+
+    real norm = (real)dims.x * dims.y * factor;
+    real scale = gain / (pow((real)(LAMBDA * lensDistance), 2) * norm * norm);
+
+    real sum = 0;
+    for (size_t j = 0; j < factor; ++j)
+        for (size_t i = 0; i < factor; ++i)
+        {
+            size_t e = (by * factor + j) * block.x + (bx * factor + i);
+            real2 A = get_slot(v, e, COL_SLOT(block));
+            sum += A.x * A.x + A.y * A.y;
+        }
 
-    float2 A = v[cx * dims.x + cy].xy;
-    float far = pow(LAMBDA * lensDistance, 2);
-    float intensity = (A.x * A.x + A.y * A.y) / far;
-    write_imagef(fraunhofer, (int2)(x, y), (float4)intensity);
+    size_t x = ((offset + bx * factor + dims.x / 2) % dims.x) / factor;
+    size_t y = ((by * factor + dims.y / 2) % dims.y) / factor;
+    float intensity = (float)(sum * scale);
+    write_imagef(fraunhofer, (int2)(x, y), (float4)ENCODE(intensity));
 }
@@ -1,37 +1,248 @@
-void kernel cl_lens(global float4 *render, private Params dims,
+/* Loads and stores a whole pixel of the accumulation buffer (any layout).
+ * With HALF_STORAGE each pixel is a half4 holding the square root of the
+ * running mean of all of its samples so far, rather than a float4 sum and
+ * count: the output takes that square root anyway, and it keeps the faint
+ * wings of the pattern well within the normal range of half (see README). */
+float4 load(global RENDER *render, size_t pixel)
+{
+#ifdef HALF_STORAGE
+    float4 value = vload_half4(pixel, render);
+    return (float4)(value.xyz * value.xyz, value.w);
+#else
+    return render[pixel];
+#endif
+}
+
+void store(global RENDER *render, size_t pixel, float4 value)
+{
+#ifdef HALF_STORAGE
+    vstore_half4((float4)(sqrt(value.xyz), value.w), pixel, render);
+#else
+    render[pixel] = value;
+#endif
+}
+
+/* Adds the sum of some samples to a pixel, prior of them having been added
+ * before this launch. In half storage, samples are summed in float registers
+ * and the mean is only rounded to half once per launch, so the stored
+ * magnitude (and its rounding error) does not grow with the number of
+ * accumulated samples. The first pass (prior of zero) overwrites the pixel,
+ * so the buffer needs no clearing. There is at least one sample per launch
+ * (main rejects fewer). */
+void accumulate(global RENDER *render, size_t pixel, float3 run,
+                uint samples, uint prior)
+{
+#ifdef HALF_STORAGE
+    float4 mean = (float4)(run / samples, 1);
+    if (prior > 0)
+    {
+        mean.xyz = load(render, pixel).xyz;
+        mean.xyz += (run - samples * mean.xyz) / (float)(prior + samples);
+    }
+
+    store(render, pixel, mean);
+#else
+    if (prior == 0) render[pixel] = (float4)(run, samples);
+    else render[pixel] += (float4)(run, samples);
+#endif
+}
+
+/* Looks up the Fraunhofer image of the given tile of an atlas (see cl_fft_col)
+ * at normalized coordinates s within it. Lookups more than half a texel out
+ * of the image only see the border (zero) when it is on its own, but would
+ * reach into the next tile of an atlas, so they are cut off here; closer ones
+ * filter against the row of zeros between tiles just as against the border.
+ * An atlas of one tile is the plain image. */
+float fetch(read_only image2d_t fraunhofer, float2 s, Params dims, size_t tile)
+{
+    float2 margin = (float2)(0.5f / dims.x, 0.5f / dims.y);
+    if (any(s < -margin) || any(s > 1 + margin)) return 0;
+
+#ifdef HALF_STORAGE
+    /* The image holds square roots (see ENCODE), which are squared before
+     * they are interpolated, exactly as the sampler would do it. */
+    float2 u = s * (float2)(dims.x, dims.y) - 0.5f, f = u - floor(u);
+    int2 p = convert_int2(floor(u)) + (int2)(0, (int)(tile * (dims.y + 1)));
+    float a = read_imagef(fraunhofer, texels, p).x;
+    float b = read_imagef(fraunhofer, texels, p + (int2)(1, 0)).x;
+    float c = read_imagef(fraunhofer, texels, p + (int2)(0, 1)).x;
+    float d = read_imagef(fraunhofer, texels, p + (int2)(1, 1)).x;
+    return mix(mix(a * a, b * b, f.x), mix(c * c, d * d, f.x), f.y);
+#else
+    s.y = (s.y * dims.y + tile * (dims.y + 1)) / get_image_height(fraunhofer);
+    return read_imagef(fraunhofer, sampler, s).x;
+#endif
+}
+
+/* Returns the sum of the given number of XYZ samples about pixel (px, py).
+ * With bands, each tile of the atlas is followed by the images of the other
+ * bands, and every wavelength looks up the image of its band, which is
+ * evaluated at the center wavelength of the band if scaled (see cl_chirp_col)
+ * or else at LAMBDA (for the pupils of cl_pupil). */
+float3 sample(PRNG *prng, size_t px, size_t py, Params dims, size_t tile,
+              read_only image2d_t fraunhofer,
+              read_only image2d_t spectrum,
+              uint samples, uint bands, bool scaled)
+{
+    float3 run = (float3)(0, 0, 0);
+    for (size_t t = 0; t < samples; ++t)
+    {
+        float wavelength = (float)t / samples;
+        float dx = (float)(px + BLUR * (rand(prng) - 0.5f)) / dims.x;
+        float dy = (float)(py + BLUR * (rand(prng) - 0.5f)) / dims.y;
+        dx -= 0.5f; dy -= 0.5f;
+
+        float ref = LAMBDA;
+        size_t image = tile;
+
+        if (bands > 0)
+        {
+            uint band = min((uint)(wavelength * bands), bands - 1);
+            if (scaled) ref = BAND(band, bands);
+            image = tile * bands + band;
+        }
+
+        /* Scaling the image with the wavelength is exact in the far field,
+         * but only approximate with the Fresnel chirp, whose rate also
+         * varies with it (the image is exact at ref, see fft.cl). */
+        float sx = dx * ((wavelength * 400 + 390) / ref);
+        float sy = dy * ((wavelength * 400 + 390) / ref);
+
+        float r = (rand(prng) > 0.5f) ? 1.0f : -1.0f;
+        float angle = r * (1.0f - pow(rand(prng), RINGING)) * RADIAN(ROTATE);
+
+        float rx = sx, ry = sy;
+        sx = rx * cos(angle) + ry * sin(angle);
+        sy = ry * cos(angle) - rx * sin(angle);
+
+        /* The zero frequency is at the center of texel (x/2, y/2). */
+        sx += 0.5f + 0.5f / dims.x; sy += 0.5f + 0.5f / dims.y;
+        float intensity = fetch(fraunhofer, (float2)(sx, sy), dims, image);
+        float2 at = (float2)(wavelength, 0);
+        float3 xyz = read_imagef(spectrum, sampler, at).xyz;
+        run += xyz * intensity;
+    }
+
+    return run;
+}
+
+/* The intensity of a real aperture is centrally symmetric, so only the right
+ * half-plane is sampled and each result is also written to the mirror pixel
+ * (x - px, y - py), which sees the same sample with its jitter negated. The
+ * noise of the two halves is then the same, mirrored, rather than independent
+ * (sampling them separately would cost as much as cl_lens_wedge at order 1,
+ * which FullPlane selects in config.xml for that reason). This
+ * needs (x/2 + 1) * (y + 1) work-items: the extra column and row are virtual,
+ * and exist only to reach the mirrors of the left column and top row. For a
+ * batch, as many work-items again are launched for each further tile, whose
+ * renders follow each other in the buffer (as in cl_replicate). */
+void kernel cl_lens(global RENDER *render, private Params dims,
                     read_only image2d_t fraunhofer,
                     read_only image2d_t spectrum,
                     private uint samples,
-                    private ulong seed)
+                    private ulong seed,
+                    private uint prior,
+                    private uint bands,
+                    private uint scaled)
 {
-	size_t index = get_global_id(0);
+    size_t index = get_global_id(0);
     PRNG prng = init(index, seed);
-    size_t px = index % dims.x, py = index / dims.x;
-	if (px < dims.x / 2) { px = dims.x - px; py = dims.y - py; }
-
-	float3 run = (float3)(0, 0, 0);
-	for (size_t t = 0; t < samples; ++t)
-	{
-    	float wavelength = (float)t / samples;
-		float dx = (float)(px + BLUR * (rand(&prng) - 0.5f)) / dims.x;
-		float dy = (float)(py + BLUR * (rand(&prng) - 0.5f)) / dims.y;
-		dx -= 0.5f; dy -= 0.5f;
-
-		float sx = dx * ((wavelength * 400 + 390) / LAMBDA);
-		float sy = dy * ((wavelength * 400 + 390) / LAMBDA);
-
-		float r = (rand(&prng) > 0.5f) ? 1.0f : -1.0f;
-		float angle = r * (1.0f - pow(rand(&prng), RINGING)) * RADIAN(ROTATE);
-
-		float rx = sx, ry = sy;
-		sx = rx * cos(angle) + ry * sin(angle);
-		sy = ry * cos(angle) - rx * sin(angle);
-
-		sx += 0.5f; sy += 0.5f;
-		float intensity = read_imagef(fraunhofer, sampler, (float2)(sx, sy)).x;
-		float3 xyz = read_imagef(spectrum, sampler, (float2)(wavelength, 0)).xyz;
-		run += xyz * intensity;
-	}
-
-	render[index] += (float4)(run, samples);
+    size_t span = (dims.x / 2 + 1) * (dims.y + 1);
+    size_t tile = index / span, base = tile * dims.x * dims.y;
+    size_t px = dims.x / 2 + (index % span) % (dims.x / 2 + 1);
+    size_t py = (index % span) / (dims.x / 2 + 1);
+
+    float3 run = sample(&prng, px, py, dims, tile, fraunhofer, spectrum,
+                        samples, bands, scaled);
+
+    if ((px < dims.x) && (py < dims.y))
+        accumulate(render, base + py * dims.x + px, run, samples, prior);
+
+    if ((px > dims.x / 2) && (py > 0))
+        accumulate(render, base + (dims.y - py) * dims.x + (dims.x - px),
+                   run, samples, prior);
+}
+
+/* An aperture with n-fold rotational symmetry has a pattern with an order of
+ * 2n (n odd) or n (n even), so only one angular wedge (2pi / order) of it is
+ * sampled while the rest is rotated in by cl_replicate. The wedge is centered
+ * on the image diagonal, where it reaches furthest out, and also covers a
+ * margin of a few pixels so that every bilinear lookup made by cl_replicate
+ * lands on sampled pixels. Pixels whose rotated source would fall outside the
+ * image (only in the far corners) are sampled directly as well. Rotations are
+ * in pixels, so the image must be square unless the order is 1 or 2 (whose
+ * rotation by pi maps pixels onto pixels): a wedge of order 1 is the whole
+ * image, for patterns with no symmetry at all (see cl_pupil). */
+#define MARGIN 2.0f
+
+/* Returns whether pixel (px, py) is to be sampled rather than replicated, in
+ * which case its source (the pixel rotated into the wedge) is also
+ * returned. */
+bool direct(size_t px, size_t py, Params dims, uint order, float2 *source)
+{
+    float wedge = 2 * PI / order, base = PI / 4 - wedge / 2;
+    float2 d = (float2)((float)px - dims.x / 2, (float)py - dims.y / 2);
+    float radius = length(d);
+
+    float phi = atan2(d.y, d.x) - base;
+    phi -= 2 * PI * floor(phi / (2 * PI));
+    float k = floor(phi / wedge);
+
+    float delta = min(phi - wedge, 2 * PI - phi);
+    if ((k == 0) || (radius * sin(min(delta, PI / 2)) <= MARGIN)) return true;
+
+    float c = cos(k * wedge), s = sin(k * wedge);
+    *source = (float2)(d.x * c + d.y * s, d.y * c - d.x * s)
+            + (float2)(dims.x / 2, dims.y / 2);
+
+    return (source->x < 0) || (source->x >= dims.x - 1)
+        || (source->y < 0) || (source->y >= dims.y - 1);
+}
+
+void kernel cl_lens_wedge(global RENDER *render, private Params dims,
+                          read_only image2d_t fraunhofer,
+                          read_only image2d_t spectrum,
+                          private uint samples,
+                          private ulong seed,
+                          private uint prior,
+                          private uint order,
+                          private uint bands,
+                          private uint scaled)
+{
+    size_t index = get_global_id(0);
+    size_t tile = index / (dims.x * dims.y);
+    size_t px = index % dims.x, py = (index / dims.x) % dims.y;
+
+    float2 source;
+    if (!direct(px, py, dims, order, &source)) return;
+
+    PRNG prng = init(index, seed);
+    float3 run = sample(&prng, px, py, dims, tile, fraunhofer, spectrum,
+                        samples, bands, scaled);
+    accumulate(render, index, run, samples, prior);
+}
+
+/* Fills in every pixel not sampled by cl_lens_wedge, once all passes are done,
+ * by bilinear interpolation at its rotated source (whose four neighbours are
+ * always sampled pixels, so they are never written here). Each tile of a
+ * batch is a whole render, following the previous one in the buffer. */
+void kernel cl_replicate(global RENDER *render, private Params dims,
+                         private uint order)
+{
+    size_t index = get_global_id(0);
+    size_t base = index - index % (dims.x * dims.y);
+    size_t px = index % dims.x, py = (index / dims.x) % dims.y;
+
+    float2 source;
+    if (direct(px, py, dims, order, &source)) return;
+
+    int2 p = convert_int2(floor(source));
+    float2 f = source - floor(source);
+
+    float4 a = load(render, base + (p.y + 0) * dims.x + (p.x + 0));
+    float4 b = load(render, base + (p.y + 0) * dims.x + (p.x + 1));
+    float4 c = load(render, base + (p.y + 1) * dims.x + (p.x + 0));
+    float4 d = load(render, base + (p.y + 1) * dims.x + (p.x + 1));
+
+    store(render, index, mix(mix(a, b, f.x), mix(c, d, f.x), f.y));
 }
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <utility.hpp>
+#include <istream>
+#include <string>
+
+/* Header of a PPM aperture file, either in plain (P3) or raw (P6) format. */
+struct PPMHeader
+{
+    std::string format;
+    size_t dim_x, dim_y;
+    size_t resolution;
+};
+
+/* Reads the header of a PPM file, returning false if it is not supported. */
+bool ReadHeader(std::istream &stream, PPMHeader &header);
+
+/* Reads the pixels following the header into aperture (rows of which are
+ * stride elements apart, so that it can be padded), as amplitude
+ * transmissions, and returns their sum. The bounds of the nonzero pixels are
+ * also returned, if bounds is not null. */
+double ReadAperture(std::istream &stream, const PPMHeader &header,
+                    float threshold, cl_float4 *aperture, size_t stride,
+                    Bounds *bounds);
+double ReadAperture(std::istream &stream, const PPMHeader &header,
+                    float threshold, cl_double4 *aperture, size_t stride,
+                    Bounds *bounds);
+
+/* Reads the pixels into the center of a field of dim_x by dim_y elements (of
+ * double4 if wide, else float4), the rest of which is cleared, and returns
+ * their sum and bounds within the field (see Oversample in OpenInput). */
+double ReadPaddedAperture(std::istream &stream, const PPMHeader &header,
+                          float threshold, bool wide, void *field,
+                          size_t dim_x, size_t dim_y, Bounds &bounds);
+
+/* Reads an optical path difference map into the center of a field of dim_x
+ * by dim_y floats, the rest of which is cleared. Gray levels 0 to 1 map to
+ * -scale to scale (in nanometers). */
+void ReadPaddedOPD(std::istream &stream, const PPMHeader &header, float scale,
+                   float *field, size_t dim_x, size_t dim_y);
+
+/* Parameters of a procedural aperture (mirrors Procedural in aperture.cl). All
+ * lengths are relative to the aperture width, angles are in degrees. */
+struct ProceduralAperture
+{
+    cl_uint blades;         /* Number of iris blades (0 for a circle). */
+    cl_float radius;        /* Circumradius of the iris. */
+    cl_float rotation;      /* Rotation of the blades and vanes. */
+    cl_float roundness;     /* 0 for straight blades, 1 for a circle. */
+    cl_float obstruction;   /* Central obstruction, relative to radius. */
+    cl_uint vanes;          /* Number of spider vanes. */
+    cl_float vaneWidth;     /* Width of the vanes, relative to radius. */
+    cl_float dust;          /* Fraction of the aperture covered in dust. */
+    cl_float dustSize;      /* Radius of the dust specks, relative to radius. */
+    cl_uint seed;           /* Seed for the dust distribution. */
+    cl_uint supersampling;  /* Antialiasing subsamples per pixel axis. */
+};
+
+/* Largest dust coverage, with a speck in every cell (see speck in
+ * aperture.cl), which is 7 pi / 192 or about 11%. */
+#define MAX_DUST (7 * 3.14159265358979 / 192)
+
+double ProceduralArea(const ProceduralAperture &aperture);
+
+/* Returns bounds enclosing the aperture, as generated at the given size. */
+Bounds ProceduralBounds(const ProceduralAperture &aperture,
+                        size_t dim_x, size_t dim_y);
+
+/* Phase aberrations of the pupil (mirrors Aberration in aperture.cl), as the
+ * RMS optical path difference, in nanometers, of each Zernike term (in Noll's
+ * normalization) over the pupil, of radius relative to the aperture width. */
+struct Aberration
+{
+    cl_float radius;
+    cl_float defocus;
+    cl_float astigmatismX, astigmatismY;
+    cl_float comaX, comaY;
+    cl_float spherical;
+};
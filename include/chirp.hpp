@@ -0,0 +1,10 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <cstddef>
+
+/* Returns the tables of the chirp-z transform along an axis of n elements
+ * (see chirp.cl), for each of the given number of wavelength bands, in the
+ * precision of the FFT (double if wide is set). They are computed in double
+ * precision whatever the precision of the FFT. */
+cl::Buffer ChirpTable(cl::Context context, size_t n, size_t bands, bool wide);
@@ -0,0 +1,493 @@
+#pragma once
+
+/* FFT codelets for the CPU backend (see cpufft.hpp). The same code is built
+ * once per instruction set, by a translation unit in src/cpu/ which defines
+ * CPU_ISA (the namespace everything goes into, so that the builds never mix)
+ * and instantiates Transform2D for the widest vector of floats it has, and
+ * the vector of as many ints for its shuffles. A vector holds one element
+ * from each of as many independent transforms, so the butterflies never
+ * shuffle lanes: columns are vectorized across adjacent columns, and rows
+ * across adjacent rows after a transpose in registers. The rows and blocks
+ * of columns are split between threads with OpenMP. The transforms are
+ * radix 16 (then 8, 4 or 2 for the remaining factor) self-sorting Stockham
+ * passes, each butterfly being a codelet: a DFT of 2 to 16 points split
+ * recursively at compile time, so that it is straight line code with
+ * constant twiddles once inlined. */
+#ifndef CPU_ISA
+#error "CPU_ISA must name the instruction set being built for"
+#endif
+
+#include <cpufft.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+#include <cmath>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+/* The transposes of the six-step FFT (see Transform2D) are done in bands of
+ * TRANSPOSE_BAND columns, down to squares of TRANSPOSE_LEAF. */
+#define TRANSPOSE_BAND 64
+#define TRANSPOSE_LEAF 16
+
+/* Bytes in a cache line, and the floats in one, which is the number of
+ * columns transformed together. */
+#define CACHE_LINE 64
+#define COLUMN_BLOCK 16
+
+namespace CPU_ISA
+{
+
+/* The 16th roots of unity e^(-2 pi i k / 16) for k < 8, which are those of
+ * every radix up to 16. */
+static const float rootRe[8] = {
+    1.000000000f, 0.923879533f, 0.707106781f, 0.382683432f,
+    0.000000000f, -0.382683432f, -0.707106781f, -0.923879533f
+};
+
+static const float rootIm[8] = {
+    -0.000000000f, -0.382683432f, -0.707106781f, -0.923879533f,
+    -1.000000000f, -0.923879533f, -0.707106781f, -0.382683432f
+};
+
+/* In-place DFT of R points (R a power of two up to 16), as the DFTs of the
+ * even and odd points combined with the roots of R. */
+template <size_t R, typename V>
+struct Codelet
+{
+    static inline void Run(V *re, V *im)
+    {
+        V er[R / 2], ei[R / 2], odr[R / 2], odi[R / 2];
+
+        for (size_t k = 0; k < R / 2; ++k)
+        {
+            er[k] = re[2 * k]; ei[k] = im[2 * k];
+            odr[k] = re[2 * k + 1]; odi[k] = im[2 * k + 1];
+        }
+
+        Codelet<R / 2, V>::Run(er, ei);
+        Codelet<R / 2, V>::Run(odr, odi);
+
+        for (size_t k = 0; k < R / 2; ++k)
+        {
+            float c = rootRe[k * (16 / R)], s = rootIm[k * (16 / R)];
+            V tr = odr[k] * c - odi[k] * s, ti = odr[k] * s + odi[k] * c;
+            re[k] = er[k] + tr; im[k] = ei[k] + ti;
+            re[k + R / 2] = er[k] - tr; im[k + R / 2] = ei[k] - ti;
+        }
+    }
+};
+
+template <typename V>
+struct Codelet<1, V>
+{
+    static inline void Run(V*, V*) { }
+};
+
+/* One radix R pass of a Stockham FFT of N points, over the subtransforms of
+ * n points spaced s apart, from x to y. The twiddles are the roots of N. */
+template <size_t R, typename V>
+static void Pass(size_t N, size_t n, size_t s, const V *xr, const V *xi,
+                 V *yr, V *yi, const float *wr, const float *wi)
+{
+    size_t m = n / R, step = N / n;
+
+    for (size_t p = 0; p < m; ++p)
+    {
+        float c[R], d[R];
+        for (size_t k = 0; k < R; ++k)
+        {
+            c[k] = wr[p * k * step]; d[k] = wi[p * k * step];
+        }
+
+        for (size_t q = 0; q < s; ++q)
+        {
+            V re[R], im[R];
+            for (size_t r = 0; r < R; ++r)
+            {
+                re[r] = xr[q + s * (p + r * m)];
+                im[r] = xi[q + s * (p + r * m)];
+            }
+
+            Codelet<R, V>::Run(re, im);
+
+            for (size_t k = 0; k < R; ++k)
+            {
+                size_t j = q + s * (R * p + k);
+                yr[j] = re[k] * c[k] - im[k] * d[k];
+                yi[j] = re[k] * d[k] + im[k] * c[k];
+            }
+        }
+    }
+}
+
+/* FFT of n points in x, using y as scratch, with the roots w of n. */
+template <typename V>
+static void Transform(size_t n, V *xr, V *xi, V *yr, V *yi,
+                      const float *wr, const float *wi)
+{
+    V *ar = xr, *ai = xi, *br = yr, *bi = yi;
+
+    for (size_t left = n, s = 1; left > 1; )
+    {
+        size_t R = (left >= 16) ? 16 : left;
+
+        switch (R)
+        {
+            case 16: Pass<16>(n, left, s, ar, ai, br, bi, wr, wi); break;
+            case 8:  Pass<8>(n, left, s, ar, ai, br, bi, wr, wi); break;
+            case 4:  Pass<4>(n, left, s, ar, ai, br, bi, wr, wi); break;
+            default: Pass<2>(n, left, s, ar, ai, br, bi, wr, wi); break;
+        }
+
+        std::swap(ar, br); std::swap(ai, bi);
+        left /= R; s *= R;
+    }
+
+    if (ar != xr)
+    {
+        memcpy(xr, ar, n * sizeof(V));
+        memcpy(xi, ai, n * sizeof(V));
+    }
+}
+
+/* Planes of floats, from CpuAllocate (so aligned to a page, and untouched
+ * until the threads which transform them write to them). Everything the
+ * codelets allocate is one, so that no library template is instantiated
+ * here: each build would emit its own weak copy, compiled for its
+ * instruction set, and the linker could pick any of them for every caller. */
+struct Plane
+{
+    float *p;
+    size_t bytes;
+
+    explicit Plane(size_t n) : bytes(n * sizeof(float))
+    {
+        p = (float*)CpuAllocate(bytes);
+        if (!p) throw std::bad_alloc();
+    }
+
+    ~Plane() { CpuFree(p, bytes); }
+
+private:
+    Plane(const Plane&);
+    Plane& operator=(const Plane&);
+};
+
+/* Scratch vectors, in a plane of their own (allocated by the thread which
+ * uses them): groups of n of them to transform, and n more as the other
+ * half of each Stockham pass. */
+template <typename V>
+struct Scratch
+{
+    Plane buffer;
+    V *xr, *xi, *yr, *yi;
+
+    explicit Scratch(size_t n, size_t groups = 1)
+        : buffer(2 * (groups + 1) * n * (sizeof(V) / sizeof(float)))
+    {
+        xr = (V*)buffer.p; xi = xr + groups * n; yr = xi + groups * n;
+        yi = yr + n;
+    }
+};
+
+/* The roots of unity e^(-2 pi i k / n), for k < n. */
+struct Roots
+{
+    Plane buffer;
+    float *wr, *wi;
+
+    explicit Roots(size_t n) : buffer(2 * n)
+    {
+        wr = buffer.p; wi = buffer.p + n;
+        for (size_t k = 0; k < n; ++k)
+        {
+            wr[k] = (float)cos(-2 * M_PI * k / n);
+            wi[k] = (float)sin(-2 * M_PI * k / n);
+        }
+    }
+};
+
+/* Stores a vector of Bytes, aligned, with a non-temporal store where the
+ * instruction set has one, since the transposes write far more than fits
+ * in the cache and never read it back before the next pass. */
+template <size_t Bytes>
+struct Stream
+{
+    static inline void Store(float *p, const void *v) { memcpy(p, v, Bytes); }
+    static inline void Fence() { }
+};
+
+#ifdef __SSE__
+template <>
+struct Stream<16>
+{
+    static inline void Store(float *p, const void *v)
+    {
+        __m128 m; memcpy(&m, v, 16); _mm_stream_ps(p, m);
+    }
+
+    static inline void Fence() { _mm_sfence(); }
+};
+#endif
+
+#ifdef __AVX__
+template <>
+struct Stream<32>
+{
+    static inline void Store(float *p, const void *v)
+    {
+        __m256 m; memcpy(&m, v, 32); _mm256_stream_ps(p, m);
+    }
+
+    static inline void Fence() { _mm_sfence(); }
+};
+#endif
+
+#ifdef __AVX512F__
+template <>
+struct Stream<64>
+{
+    static inline void Store(float *p, const void *v)
+    {
+        __m512 m; memcpy(&m, v, 64); _mm512_stream_ps(p, m);
+    }
+
+    static inline void Fence() { _mm_sfence(); }
+};
+#endif
+
+/* Transposes the block of rows [r0, r1) and columns [c0, c1) of the rows by
+ * cols matrix src into the cols by rows matrix dst, recursively halving the
+ * longer side so that the blocks end up fitting whatever cache there is,
+ * down to squares of TRANSPOSE_LEAF (at least W, the vector width, and a
+ * cache line's worth of floats). The destination is written a line at a
+ * time, streamed if the lines are whole. */
+template <typename V>
+static void Transpose(const float *src, float *dst, size_t rows, size_t cols,
+                      size_t r0, size_t r1, size_t c0, size_t c1, bool stream)
+{
+    const size_t W = sizeof(V) / sizeof(float), leaf = TRANSPOSE_LEAF;
+
+    if ((r1 - r0 > leaf) || (c1 - c0 > leaf))
+    {
+        if (r1 - r0 >= c1 - c0)
+        {
+            size_t r = r0 + (r1 - r0) / 2;
+            Transpose<V>(src, dst, rows, cols, r0, r, c0, c1, stream);
+            Transpose<V>(src, dst, rows, cols, r, r1, c0, c1, stream);
+        }
+        else
+        {
+            size_t c = c0 + (c1 - c0) / 2;
+            Transpose<V>(src, dst, rows, cols, r0, r1, c0, c, stream);
+            Transpose<V>(src, dst, rows, cols, r0, r1, c, c1, stream);
+        }
+
+        return;
+    }
+
+    /* Each column of the square is gathered into a line, which is stored
+     * whole, so that streaming never leaves part of a cache line. */
+    for (size_t c = c0; c < c1; ++c)
+    {
+        V line[TRANSPOSE_LEAF / W];
+        for (size_t r = r0; r < r1; ++r)
+            ((float*)line)[r - r0] = src[r * cols + c];
+
+        for (size_t k = 0; k < (r1 - r0) / W; ++k)
+        {
+            float *p = &dst[c * rows + r0 + k * W];
+            if (stream) Stream<sizeof(V)>::Store(p, &line[k]);
+            else memcpy(p, &line[k], sizeof(V));
+        }
+    }
+}
+
+/* Transposes both planes, in parallel over bands of destination rows, so
+ * that the threads stream to separate (and contiguous) memory. */
+template <typename V>
+static void TransposePlanes(const float *re, const float *im, float *tre,
+                            float *tim, size_t rows, size_t cols)
+{
+    const size_t W = sizeof(V) / sizeof(float);
+    const long band = (long)std::max(W, (size_t)TRANSPOSE_BAND);
+    bool stream = ((uintptr_t)tre % CACHE_LINE == 0)
+               && ((uintptr_t)tim % CACHE_LINE == 0);
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static)
+        for (long c = 0; c < (long)cols; c += band)
+        {
+            size_t c1 = std::min(cols, (size_t)(c + band));
+            Transpose<V>(re, tre, rows, cols, 0, rows, c, c1, stream);
+            Transpose<V>(im, tim, rows, cols, 0, rows, c, c1, stream);
+        }
+
+        if (stream) Stream<sizeof(V)>::Fence();
+    }
+}
+
+/* Transposes the W by W matrix of the lanes of W vectors in registers, by
+ * swapping the off-diagonal blocks of h by h lanes for h = W / 2 down to 1.
+ * M is a vector of as many ints as V has floats, for the shuffle masks. */
+template <typename V, typename M>
+struct Lanes
+{
+    static inline void Transpose(V *r)
+    {
+        const size_t W = sizeof(V) / sizeof(float);
+
+        for (size_t h = W / 2; h > 0; h /= 2)
+        {
+            M lo, hi;
+            for (size_t j = 0; j < W; ++j)
+            {
+                lo[j] = (j & h) ? (int)(W + j - h) : (int)j;
+                hi[j] = (j & h) ? (int)(W + j) : (int)(j + h);
+            }
+
+            for (size_t i = 0; i < W; ++i)
+                if (!(i & h))
+                {
+                    V a = r[i], b = r[i + h];
+                    r[i] = __builtin_shuffle(a, b, lo);
+                    r[i + h] = __builtin_shuffle(a, b, hi);
+                }
+        }
+    }
+};
+
+template <>
+struct Lanes<float, int>
+{
+    static inline void Transpose(float*) { }
+};
+
+/* Transforms every row of the planes, W at a time through a transposed copy
+ * so that each lane holds one row (transposing W by W squares in registers
+ * on the way in and out). Each thread has its own copy, of 4 dim_x
+ * floats per lane, which is what the passes work in: a row is the cache
+ * sized subtransform. */
+template <typename V, typename M>
+static void Rows(float *re, float *im, size_t dim_x, size_t dim_y)
+{
+    const size_t W = sizeof(V) / sizeof(float);
+    Roots w(dim_x);
+
+    #pragma omp parallel
+    {
+        Scratch<V> t(dim_x);
+
+        #pragma omp for schedule(static)
+        for (long y = 0; y < (long)dim_y; y += W)
+        {
+            for (size_t x = 0; x < dim_x; x += W)
+            {
+                for (size_t l = 0; l < W; ++l)
+                {
+                    memcpy(&t.xr[x + l], &re[(y + l) * dim_x + x], sizeof(V));
+                    memcpy(&t.xi[x + l], &im[(y + l) * dim_x + x], sizeof(V));
+                }
+
+                Lanes<V, M>::Transpose(&t.xr[x]);
+                Lanes<V, M>::Transpose(&t.xi[x]);
+            }
+
+            Transform(dim_x, t.xr, t.xi, t.yr, t.yi, w.wr, w.wi);
+
+            for (size_t x = 0; x < dim_x; x += W)
+            {
+                Lanes<V, M>::Transpose(&t.xr[x]);
+                Lanes<V, M>::Transpose(&t.xi[x]);
+
+                for (size_t l = 0; l < W; ++l)
+                {
+                    memcpy(&re[(y + l) * dim_x + x], &t.xr[x + l], sizeof(V));
+                    memcpy(&im[(y + l) * dim_x + x], &t.xi[x + l], sizeof(V));
+                }
+            }
+        }
+    }
+}
+
+/* Transforms every column of the planes in place, a block of COLUMN_BLOCK
+ * adjacent ones (a cache line) at a time, so that every line read is used
+ * whole. The block is gathered as groups of W columns, one after the other,
+ * which are then transformed in turn. */
+template <typename V>
+static void Columns(float *re, float *im, size_t dim_x, size_t dim_y)
+{
+    const size_t W = sizeof(V) / sizeof(float);
+    const long block = (long)std::min(dim_x, std::max(W,
+                                      (size_t)COLUMN_BLOCK));
+    const size_t groups = block / W;
+    Roots w(dim_y);
+
+    #pragma omp parallel
+    {
+        Scratch<V> t(dim_y, groups);
+
+        #pragma omp for schedule(static)
+        for (long x = 0; x < (long)dim_x; x += block)
+        {
+            for (size_t y = 0; y < dim_y; ++y)
+                for (size_t g = 0; g < groups; ++g)
+                {
+                    memcpy(&t.xr[g * dim_y + y], &re[y * dim_x + x + g * W],
+                           sizeof(V));
+                    memcpy(&t.xi[g * dim_y + y], &im[y * dim_x + x + g * W],
+                           sizeof(V));
+                }
+
+            for (size_t g = 0; g < groups; ++g)
+                Transform(dim_y, t.xr + g * dim_y, t.xi + g * dim_y,
+                          t.yr, t.yi, w.wr, w.wi);
+
+            for (size_t y = 0; y < dim_y; ++y)
+                for (size_t g = 0; g < groups; ++g)
+                {
+                    memcpy(&re[y * dim_x + x + g * W], &t.xr[g * dim_y + y],
+                           sizeof(V));
+                    memcpy(&im[y * dim_x + x + g * W], &t.xi[g * dim_y + y],
+                           sizeof(V));
+                }
+        }
+    }
+}
+
+/* In-place 2D FFT of dim_x by dim_y points, as planes of their real and
+ * imaginary parts, with each dimension a multiple of the vector width.
+ *
+ * With sixStep, it is done as a six-step FFT instead (see PlanCpuFFT for
+ * when): the 2D DFT being separable, there are no twiddles between the two
+ * dimensions, so the steps are transform the rows, transpose, transform the
+ * rows (the former columns), transpose back. Every pass of the transforms
+ * then works on contiguous rows, in the cache, and only the transposes are
+ * strided, whereas gathering columns in place touches a page per point.
+ * That only pays once the page tables stop fitting in the cache as well,
+ * the extra transposes costing about a third of the transform otherwise. */
+template <typename V, typename M>
+static void Transform2D(float *re, float *im, size_t dim_x, size_t dim_y,
+                        bool sixStep)
+{
+    Rows<V, M>(re, im, dim_x, dim_y);
+
+    if (!sixStep)
+    {
+        Columns<V>(re, im, dim_x, dim_y);
+        return;
+    }
+
+    Plane tre(dim_x * dim_y), tim(dim_x * dim_y);
+    TransposePlanes<V>(re, im, tre.p, tim.p, dim_y, dim_x);
+    Rows<V, M>(tre.p, tim.p, dim_y, dim_x);
+    TransposePlanes<V>(tre.p, tim.p, re, im, dim_x, dim_y);
+}
+
+}
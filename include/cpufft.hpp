@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* CPU backend of the FFT, for machines whose CPU transforms large apertures
+ * faster than their OpenCL device (or which have none worth using). It is
+ * built for several instruction sets (see codelet.hpp), the widest of which
+ * the CPU supports being picked at run time, and runs on every core (as many
+ * as OMP_NUM_THREADS allows). Its buffers are left untouched when allocated,
+ * so that each page lands on the NUMA node of the thread which first writes
+ * it. The row passes split rows between threads the same way (static chunks
+ * of rows, in order), and so do the transposes of the six-step FFT with the
+ * rows they write, so those only read across nodes. The in-place column
+ * pass splits columns instead, so every thread works on every chunk of rows
+ * and most of its memory is on other nodes: with more than one node, the
+ * six-step FFT is used unless CPU Transform says otherwise. */
+
+/* Where the planes of a transform ended up: the share of their pages (as
+ * sampled, one per row) which are on the node of the thread that processes
+ * them, and whether they are backed by huge pages. Nodes and local pages
+ * are only known on Linux, elsewhere they are both zero. */
+struct CpuPlacement
+{
+    int threads, nodes;
+    size_t pages, local;
+    bool huge;
+};
+
+/* Sets up the worker threads, pinning each to its own CPU (of those the
+ * process may run on) if pin is set and OpenMP has not been told how to bind
+ * them already (by OMP_PROC_BIND or GOMP_CPU_AFFINITY), so that they stay on
+ * the node of the memory they touched first. The master thread is pinned
+ * only while it transforms, so that it does not pin the OpenCL runtime.
+ * Large buffers are backed by huge pages as set by hugePages: "Off",
+ * "Transparent" (advised to the kernel, which uses them when it can) or
+ * "Explicit" (from the hugetlbfs pool, or transparent ones if it is empty).
+ * Returns the number of threads. */
+int CpuSetup(bool pin, const std::string &hugePages);
+
+/* Returns the number of NUMA nodes, as found by CpuSetup (one if unknown). */
+int CpuNodes();
+
+/* Allocates bytes for the CPU backend, aligned to a page and untouched, in
+ * huge pages if so set up (in which case huge is set, if not null). */
+void* CpuAllocate(size_t bytes, bool *huge = 0);
+void CpuFree(void *ptr, size_t bytes);
+
+/* Returns the name of the instruction set in use. */
+const char* CpuISA();
+
+/* Returns the names of the instruction sets the CPU supports, widest first.
+ * CpuUseISA switches to one of them (or back to the widest, if name is
+ * empty), returning false if the CPU does not support it, so that each
+ * build can be tested. */
+std::vector<std::string> CpuISAs();
+bool CpuUseISA(const std::string &name);
+
+/* How the columns are transformed (see Transform2D in codelet.hpp): in place,
+ * or as a six-step FFT, whose transposes pay off once the columns no longer
+ * fit in the caches. Where that happens depends on the machine, so it is
+ * measured (see PlanCpuFFT in planner.hpp) or set in config.xml. */
+enum CpuMethod { CPU_COLUMNS, CPU_SIX_STEP };
+
+/* In-place 2D FFT of dim_x by dim_y points (both powers of two), as planes
+ * of their real and imaginary parts. */
+void CpuTransform(float *re, float *im, size_t dim_x, size_t dim_y,
+                  CpuMethod method);
+
+/* Transforms an aperture (of float4 elements, as on the device, since the
+ * backend is single precision only) by method and writes its Fraunhofer
+ * image, scaled and centered as by cl_fft_col, as floats or (if half) as the
+ * cl_half square roots of them. The placement of the planes is written to
+ * placement unless it is null (sampling it takes a system call per row, so
+ * it is best only asked for when profiling). */
+void CpuFraunhofer(const void *aperture, size_t dim_x, size_t dim_y,
+                   float lensDistance, float gain, bool half, void *image,
+                   CpuMethod method, CpuPlacement *placement);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <aperture.hpp>
+#include <profile.hpp>
+#include <string>
+
+/* Out-of-core FFT, for apertures which do not fit in device memory. The whole
+ * aperture lives in a host scratch area (memory, or a memory-mapped file) and
+ * the two passes stream through the device a block at a time: blocks of rows
+ * are uploaded (or generated on the device), transformed and read back, then
+ * blocks of columns are gathered from the scratch area, transformed and their
+ * intensity written to the Fraunhofer image. That image, and the render, have
+ * to fit on the device, so the intensity is decimated (averaged over squares
+ * of factor^2 elements) as needed, and the lens runs at that reduced size.
+ * Each block is transferred and transformed in turn, without overlap. */
+struct OutOfCore
+{
+    size_t dim_x, dim_y;        /* Of the aperture. */
+    size_t factor;              /* Decimation of the Fraunhofer image. */
+    size_t rows, cols;          /* Rows and columns per block. */
+    size_t element;             /* Size of an FFT element (float or double). */
+
+    char *scratch;              /* The aperture, row-major. */
+    size_t scratchSize;
+    bool mapped;                /* Whether scratch is a mapped file. */
+
+    cl::Buffer block;
+    cl::Buffer brtx, brty;
+    cl::Kernel generator, row, col, power;
+};
+
+/* Chooses the decimation factor (at least minFactor, a power of two) and
+ * block sizes for the given device (using at most budget bytes for a block,
+ * or a share of the device memory if it is zero), then allocates the scratch
+ * area, in a file at scratchPath unless it is empty, and sets up the kernels
+ * (built with STOCKHAM if stockham is set, which need no reversal tables).
+ * Returns false if any of this fails. */
+bool PlanOutOfCore(cl::Context context, cl::Device device, cl::Program program,
+                   size_t dim_x, size_t dim_y, size_t element, size_t budget,
+                   size_t minFactor, bool stockham,
+                   const std::string &scratchPath, OutOfCore &ooc);
+
+/* Runs both passes, generating the aperture from shape if it is not null (or
+ * else transforming the aperture already in the scratch area), and writing
+ * the decimated Fraunhofer image scaled as in cl_fft_col. The time taken and
+ * the transfer rate of each pass are printed. */
+void RunOutOfCore(cl::CommandQueue queue, OutOfCore &ooc, cl::Image2D image,
+                  const ProceduralAperture *shape, float lensDistance,
+                  float gain, Profile &profile, int frame);
+
+void ReleaseOutOfCore(OutOfCore &ooc);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <stdint.h>
+#include <string>
+
+/* Encodes count accumulated XYZ pixels as RGBE, four bytes each. They are
+ * float4 sums with their sample count in w, or in half storage mode (see
+ * cl_lens) half4 square roots of the means scaled by gain. */
+void EncodeRadiance(const void *pixels, size_t count, bool half, float gain,
+                    uint8_t *rgbe);
+
+/* Writes accumulated XYZ pixels (as above) to path as a Radiance RGBE image. */
+void WriteRadiance(const char *path, const void *pixels,
+                   size_t dim_x, size_t dim_y, bool half, float gain);
+
+/* Returns the output path for one frame of a sequence, numbered before the
+ * extension (frames.hdr becomes frames.0000.hdr, frames.0001.hdr, ...). */
+std::string FramePath(const std::string &path, size_t frame);
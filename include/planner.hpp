@@ -0,0 +1,31 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <string>
+
+/* FFT planner: every FFT algorithm the kernels can be built with is a
+ * candidate plan, and which is fastest depends on the device and the size,
+ * so they are all timed on the actual device and size and the fastest one is
+ * used. Decisions are kept in a wisdom file, keyed by the device, its driver
+ * version, the size and the precision, so that later runs skip the timing. */
+struct Plan
+{
+    std::string algorithm;  /* As FFT Algorithm in config.xml. */
+    double time;            /* Of one (unpruned) transform, in seconds. */
+};
+
+/* Returns the plan for an FFT of dim_x by dim_y elements (of double precision
+ * if wide) from the wisdom file at path if it holds one, or else by timing
+ * each candidate, in which case the decision is added to the file (if path
+ * is not empty). Sizes which do not fit on the device are not timed, and get
+ * the Cooley-Tukey FFT with a time of zero. */
+Plan PlanFFT(cl::Context context, cl::Device device, size_t dim_x,
+             size_t dim_y, bool wide, const std::string &path);
+
+/* As PlanFFT, for the CPU FFT (see cpufft.hpp) with its instruction set and
+ * number of threads as the device: whether its columns are best transformed
+ * in place or in six steps, which depends on the caches and memory of the
+ * machine more than on the size. The algorithm is either "Columns" or
+ * "SixStep", as CPU Transform in config.xml. */
+Plan PlanCpuFFT(size_t dim_x, size_t dim_y, int threads,
+                const std::string &path);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+
+/* One timed stage of a render, either measured on the host by wall clock or
+ * on the device from the profiling counters of the event of its command. The
+ * frame is -1 for stages which are only run once, before the first frame. */
+struct ProfileEntry
+{
+    std::string stage;
+    int frame;
+    bool device;
+    cl::Event event;
+    double issued;
+    double queued, submit;
+    double start, end;
+};
+
+/* A figure reported alongside the timings, such as where the CPU backend put
+ * its buffers (see cpufft.hpp). */
+struct ProfileCounter
+{
+    std::string name;
+    double value;
+};
+
+/* The timing report of a render. When it is disabled no events are requested
+ * from OpenCL and nothing is recorded. All times are in seconds relative to
+ * its origin; device counters are brought onto the host clock by the offset
+ * between the two at which commands are issued (a command is never queued
+ * before the host issues it, so the smallest difference is the tightest).
+ * Entries are kept in a deque so that event pointers stay valid. */
+struct Profile
+{
+    bool enabled;
+    bool resolved;
+    double origin;
+    std::deque<ProfileEntry> entries;
+    std::vector<ProfileCounter> counters;
+};
+
+Profile CreateProfile(bool enabled);
+
+/* Returns the event to pass to the enqueue call of a device stage, or a null
+ * pointer (i.e. no event) if profiling is disabled. */
+cl::Event* ProfileDevice(Profile &profile, const std::string &stage, int frame);
+
+/* Records a host stage, which ran from start to end (as given by Seconds). */
+void ProfileHost(Profile &profile, const std::string &stage, int frame,
+                 double start, double end);
+
+/* Sets a counter, replacing any earlier value under the same name. */
+void ProfileCount(Profile &profile, const std::string &name, double value);
+
+/* Writes the report to path, as CSV if its extension is .csv and as JSON
+ * otherwise (with the counters, which CSV has no room for), and prints the
+ * total time per stage and the counters. The queue must have been
+ * finished beforehand, so that every device event has completed. */
+bool WriteProfile(Profile &profile, const std::string &path);
+
+/* Writes the entries to path as a Chrome trace_event JSON file (which can be
+ * opened in Perfetto or chrome://tracing), with the host stages and device
+ * commands on separate lanes, and the time each command spent waiting in the
+ * queue before starting on a third. The same requirement as above applies. */
+bool WriteTrace(Profile &profile, const std::string &path);
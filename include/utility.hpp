@@ -2,6 +2,13 @@
 
 #include <CL/cl.hpp>
 #include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Reference wavelength, in nm: the Fraunhofer image is computed at it and
+ * stretched for the others (see lens.cl). LoadProgram passes it on to the
+ * kernels. */
+#define LAMBDA 575.0
 
 struct CLParams
 {
@@ -9,6 +16,48 @@ struct CLParams
     cl_uint dim_y, rad_y;
 };
 
+/* A buffer the host reads or writes by mapping it, either directly (devices
+ * sharing host memory, with no copy at all) or through a pinned staging copy
+ * of it on other devices, which allows for faster DMA transfers. */
+struct HostBuffer
+{
+    cl::Buffer buffer;
+    cl::Buffer staging;
+    size_t size;
+    bool unified;
+};
+
+HostBuffer CreateHostBuffer(cl::Context context, size_t size, bool unified);
+
+/* The event, if any, is that of the transfer: the staging copy if there is
+ * one, else the map or unmap command itself. */
+void* MapHostBuffer(cl::CommandQueue queue, HostBuffer &buffer,
+                    cl_map_flags flags, cl::Event *event = 0);
+void UnmapHostBuffer(cl::CommandQueue queue, HostBuffer &buffer,
+                     cl_map_flags flags, void *ptr, cl::Event *event = 0);
+
+/* Extent of the nonzero part of an aperture (x1 and y1 being exclusive). */
+struct Bounds
+{
+    size_t x0, y0, x1, y1;
+};
+
+/* Returns the window of the pruned FFT (see fft.cl) which covers the bounds
+ * in an aperture of the given dims, that is the offset and the log2 of the
+ * size of the window along each axis in place of their size and radix. The
+ * Stockham FFT can only skip an odd number of stages, so its window may be
+ * twice as large. Empty bounds give a window of a single element. */
+CLParams PruneWindow(const Bounds &bounds, const CLParams &dims, bool stockham);
+
 void ReversalTable(uint32_t size, uint32_t radix, uint32_t *table);
 uint32_t reverse(uint32_t x, uint32_t radix);
 size_t radix(size_t n);
+float HalfToFloat(cl_half h);
+cl_half FloatToHalf(float f);
+double Seconds();
+
+/* Builds the kernels for the given devices, with extra build options (such
+ * as -D HALF_STORAGE) and LAMBDA. The build log is printed if the build
+ * fails. */
+cl::Program LoadProgram(cl::Context context, std::vector<cl::Device> devices,
+                        std::string options);
@@ -0,0 +1,185 @@
+#include <aperture.hpp>
+#include <utility.hpp>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+/* Raw PPM samples of more than a byte are stored most significant first. */
+static uint16_t bigEndian(uint16_t x)
+{
+    const uint8_t *bytes = (const uint8_t*)&x;
+    return (uint16_t)((bytes[0] << 8) | bytes[1]);
+}
+
+bool ReadHeader(std::istream &stream, PPMHeader &header)
+{
+    stream >> header.format;
+    if ((header.format != "P3") && (header.format != "P6")) return false;
+    stream >> header.dim_x >> header.dim_y >> header.resolution;
+
+    /* A single whitespace character separates the header from raw data. */
+    if (header.format == "P6") stream.get();
+    return stream.good() && radix(header.dim_x) && radix(header.dim_y);
+}
+
+/* Reads the next pixel, returning the mean of its channels in [0, 1]. */
+static float Pixel(std::istream &stream, const PPMHeader &header)
+{
+    float R, G, B;
+
+    if (header.format == "P3")
+    {
+        size_t r, g, b;
+        stream >> r;
+        stream >> g;
+        stream >> b;
+
+        R = (float)r / header.resolution;
+        G = (float)g / header.resolution;
+        B = (float)b / header.resolution;
+    }
+    else
+    {
+        if (header.resolution < 256)
+        {
+            uint8_t r, g, b;
+            stream.read((char*)&r, sizeof(uint8_t));
+            stream.read((char*)&g, sizeof(uint8_t));
+            stream.read((char*)&b, sizeof(uint8_t));
+
+            R = (float)r / header.resolution;
+            G = (float)g / header.resolution;
+            B = (float)b / header.resolution;
+        }
+        else
+        {
+            uint16_t r, g, b;
+            stream.read((char*)&r, sizeof(uint16_t));
+            stream.read((char*)&g, sizeof(uint16_t));
+            stream.read((char*)&b, sizeof(uint16_t));
+            r = bigEndian(r); g = bigEndian(g); b = bigEndian(b);
+
+            R = (float)r / header.resolution;
+            G = (float)g / header.resolution;
+            B = (float)b / header.resolution;
+        }
+    }
+
+    return (R + G + B) / 3.0f;
+}
+
+/* Reads into either float4 or double4 elements (see DOUBLE_FFT). */
+template <typename T>
+static double Read(std::istream &stream, const PPMHeader &header,
+                   float threshold, T *aperture, size_t stride,
+                   Bounds *bounds)
+{
+    Bounds box = { header.dim_x, header.dim_y, 0, 0 };
+    double transmission = 0;
+
+    for (size_t y = 0; y < header.dim_y; ++y)
+        for (size_t x = 0; x < header.dim_x; ++x)
+        {
+            float A = sqrt(Pixel(stream, header));
+            if (threshold != 1) A = (A > threshold) ? 1 : 0;
+            T Aper = {{A, 0, 0, 0}};
+            aperture[y * stride + x] = Aper;
+            transmission += A;
+
+            if (A == 0) continue;
+            box.x0 = std::min(box.x0, x); box.x1 = std::max(box.x1, x + 1);
+            box.y0 = std::min(box.y0, y); box.y1 = std::max(box.y1, y + 1);
+        }
+
+    if (bounds) *bounds = box;
+    return transmission;
+}
+
+double ReadAperture(std::istream &stream, const PPMHeader &header,
+                    float threshold, cl_float4 *aperture, size_t stride,
+                    Bounds *bounds)
+{
+    return Read(stream, header, threshold, aperture, stride, bounds);
+}
+
+double ReadAperture(std::istream &stream, const PPMHeader &header,
+                    float threshold, cl_double4 *aperture, size_t stride,
+                    Bounds *bounds)
+{
+    return Read(stream, header, threshold, aperture, stride, bounds);
+}
+
+double ReadPaddedAperture(std::istream &stream, const PPMHeader &header,
+                          float threshold, bool wide, void *field,
+                          size_t dim_x, size_t dim_y, Bounds &bounds)
+{
+    size_t element = wide ? sizeof(cl_double4) : sizeof(cl_float4);
+    size_t x = (dim_x - header.dim_x) / 2, y = (dim_y - header.dim_y) / 2;
+    char *ptr = (char*)field + (y * dim_x + x) * element;
+
+    if ((x > 0) || (y > 0)) memset(field, 0, dim_x * dim_y * element);
+
+    double transmission;
+    if (wide) transmission = ReadAperture(stream, header, threshold,
+                                          (cl_double4*)ptr, dim_x, &bounds);
+    else transmission = ReadAperture(stream, header, threshold,
+                                     (cl_float4*)ptr, dim_x, &bounds);
+
+    bounds.x0 += x; bounds.x1 += x;
+    bounds.y0 += y; bounds.y1 += y;
+    return transmission;
+}
+
+void ReadPaddedOPD(std::istream &stream, const PPMHeader &header, float scale,
+                   float *field, size_t dim_x, size_t dim_y)
+{
+    size_t x0 = (dim_x - header.dim_x) / 2, y0 = (dim_y - header.dim_y) / 2;
+    std::fill(field, field + dim_x * dim_y, 0.0f);
+
+    for (size_t y = 0; y < header.dim_y; ++y)
+        for (size_t x = 0; x < header.dim_x; ++x)
+        {
+            float opd = (2 * Pixel(stream, header) - 1) * scale;
+            field[(y + y0) * dim_x + x + x0] = opd;
+        }
+}
+
+/* Approximate open area of the aperture, relative to its squared width. Dust
+ * covers its fraction of the plane on average (see speck in aperture.cl), up
+ * to MAX_DUST. */
+double ProceduralArea(const ProceduralAperture &aperture)
+{
+    const double pi = 3.14159265358979;
+    double r = aperture.radius, circle = pi * r * r, area = circle;
+
+    if (aperture.blades >= 3)
+    {
+        double n = aperture.blades;
+        double polygon = n / 2 * r * r * sin(2 * pi / n);
+        area = polygon + (circle - polygon) * aperture.roundness;
+    }
+
+    double inner = aperture.obstruction * r;
+    double vanes = aperture.vanes * aperture.vaneWidth * r * (r - inner);
+    area = std::max(0.0, area - pi * inner * inner - vanes);
+    return area * (1 - std::min(std::max(0.0, (double)aperture.dust),
+                                MAX_DUST));
+}
+
+/* The iris fits in its circumcircle, of radius relative to the width and
+ * centered on pixel (x/2, y/2), and each pixel is sampled within a unit
+ * square (plus a pixel of margin for rounding). */
+Bounds ProceduralBounds(const ProceduralAperture &aperture,
+                        size_t dim_x, size_t dim_y)
+{
+    double r = std::max(0.0f, aperture.radius) * dim_x + 1;
+    double x0 = dim_x / 2 - r, x1 = dim_x / 2 + r + 1;
+    double y0 = dim_y / 2 - r, y1 = dim_y / 2 + r + 1;
+
+    Bounds bounds;
+    bounds.x0 = (size_t)std::max(0.0, floor(x0));
+    bounds.y0 = (size_t)std::max(0.0, floor(y0));
+    bounds.x1 = (size_t)std::min((double)dim_x, ceil(x1));
+    bounds.y1 = (size_t)std::min((double)dim_y, ceil(y1));
+    return bounds;
+}
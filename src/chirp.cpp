@@ -0,0 +1,92 @@
+#include <chirp.hpp>
+#include <utility.hpp>
+#include <algorithm>
+#include <complex>
+#include <vector>
+#include <cmath>
+
+typedef std::complex<double> complex;
+
+/* Bands, as in def.cl. */
+#define BAND(b, n) (390 + 400 * ((b) + 0.5) / (n))
+
+/* In-place radix-2 FFT of n elements (n a power of two). */
+static void Transform(std::vector<complex> &v)
+{
+    size_t n = v.size(), r = radix(n);
+
+    for (size_t t = 0; t < n; ++t)
+    {
+        size_t u = reverse(t, r);
+        if (u > t) std::swap(v[t], v[u]);
+    }
+
+    for (size_t p = 1; p < n; p *= 2)
+        for (size_t k = 0; k < p; ++k)
+        {
+            complex w = std::polar(1.0, -M_PI * k / p);
+
+            for (size_t j = k; j < n; j += 2 * p)
+            {
+                complex e = v[j], o = v[j + p] * w;
+                v[j] = e + o; v[j + p] = e - o;
+            }
+        }
+}
+
+cl::Buffer ChirpTable(cl::Context context, size_t n, size_t bands, bool wide)
+{
+    size_t m = 2 * n;
+    std::vector<complex> table(bands * 2 * m), kernel(m);
+
+    for (size_t b = 0; b < bands; ++b)
+    {
+        double alpha = BAND(b, bands) / LAMBDA / n;
+        complex *pre = &table[b * 2 * m], *post = pre + n;
+
+        for (size_t t = 0; t < n; ++t)
+        {
+            double k = (double)t;
+            pre[t] = std::polar(1.0, M_PI * alpha * (n * k - k * k));
+            post[t] = std::polar(1.0, -M_PI * alpha * k * k);
+        }
+
+        /* The chirp, at -(n - 1) to n - 1 (wrapped around), is convolved
+         * with so its FFT is all that is needed. */
+        std::fill(kernel.begin(), kernel.end(), complex(0));
+        for (size_t t = 0; t < n; ++t)
+        {
+            double k = (double)t;
+            kernel[t] = std::polar(1.0, M_PI * alpha * k * k);
+            kernel[(m - t) % m] = kernel[t];
+        }
+
+        Transform(kernel);
+        std::copy(kernel.begin(), kernel.end(), pre + m);
+    }
+
+    cl_mem_flags flags = CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR;
+    size_t count = table.size();
+
+    if (wide)
+    {
+        std::vector<cl_double2> data(count);
+        for (size_t t = 0; t < count; ++t)
+        {
+            data[t].s[0] = table[t].real();
+            data[t].s[1] = table[t].imag();
+        }
+
+        return cl::Buffer(context, flags, count * sizeof(cl_double2),
+                          &data[0]);
+    }
+
+    std::vector<cl_float2> data(count);
+    for (size_t t = 0; t < count; ++t)
+    {
+        data[t].s[0] = (float)table[t].real();
+        data[t].s[1] = (float)table[t].imag();
+    }
+
+    return cl::Buffer(context, flags, count * sizeof(cl_float2), &data[0]);
+}
@@ -0,0 +1,17 @@
+#define CPU_ISA avx2
+#include <codelet.hpp>
+
+/* AVX2 build (see the target specific flags in the Makefile). */
+namespace avx2
+{
+
+typedef float Vector __attribute__((vector_size(32)));
+typedef int Mask __attribute__((vector_size(32)));
+
+void Transform(float *re, float *im, size_t dim_x, size_t dim_y,
+               bool sixStep)
+{
+    Transform2D<Vector, Mask>(re, im, dim_x, dim_y, sixStep);
+}
+
+}
@@ -0,0 +1,17 @@
+#define CPU_ISA avx512
+#include <codelet.hpp>
+
+/* AVX-512 build (see the target specific flags in the Makefile). */
+namespace avx512
+{
+
+typedef float Vector __attribute__((vector_size(64)));
+typedef int Mask __attribute__((vector_size(64)));
+
+void Transform(float *re, float *im, size_t dim_x, size_t dim_y,
+               bool sixStep)
+{
+    Transform2D<Vector, Mask>(re, im, dim_x, dim_y, sixStep);
+}
+
+}
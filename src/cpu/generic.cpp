@@ -0,0 +1,14 @@
+#define CPU_ISA generic
+#include <codelet.hpp>
+
+/* Scalar build, for any CPU (and dimensions below the vector widths). */
+namespace generic
+{
+
+void Transform(float *re, float *im, size_t dim_x, size_t dim_y,
+               bool sixStep)
+{
+    Transform2D<float, int>(re, im, dim_x, dim_y, sixStep);
+}
+
+}
@@ -0,0 +1,17 @@
+#define CPU_ISA sse2
+#include <codelet.hpp>
+
+/* SSE2 build (see the target specific flags in the Makefile). */
+namespace sse2
+{
+
+typedef float Vector __attribute__((vector_size(16)));
+typedef int Mask __attribute__((vector_size(16)));
+
+void Transform(float *re, float *im, size_t dim_x, size_t dim_y,
+               bool sixStep)
+{
+    Transform2D<Vector, Mask>(re, im, dim_x, dim_y, sixStep);
+}
+
+}
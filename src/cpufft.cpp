@@ -0,0 +1,385 @@
+#include <cpufft.hpp>
+#include <utility.hpp>
+#include <stdint.h>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <vector>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+/* Buffers are backed by huge pages from this size up, and rounded up to a
+ * multiple of it (which hugetlbfs requires). */
+#define HUGE_PAGE ((size_t)2 << 20)
+
+enum HugePages { HUGE_OFF, HUGE_TRANSPARENT, HUGE_EXPLICIT };
+static HugePages hugePages = HUGE_TRANSPARENT;
+
+/* The CPUs the threads are pinned to (none if they are not), and the number
+ * of NUMA nodes, as found by CpuSetup. */
+static std::vector<int> cpus;
+static int nodes = 1;
+
+/* Each of these is built from codelet.hpp in src/cpu/. */
+namespace generic { void Transform(float*, float*, size_t, size_t, bool); }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+namespace sse2 { void Transform(float*, float*, size_t, size_t, bool); }
+namespace avx2 { void Transform(float*, float*, size_t, size_t, bool); }
+namespace avx512 { void Transform(float*, float*, size_t, size_t, bool); }
+#endif
+
+typedef void (*TransformFunction)(float*, float*, size_t, size_t, bool);
+
+struct Backend
+{
+    const char *name;
+    size_t width;               /* Floats per vector. */
+    TransformFunction transform;
+};
+
+/* Returns the backends the CPU supports, widest first. */
+static const std::vector<const Backend*>& Supported()
+{
+    static const Backend scalar = { "generic", 1, generic::Transform };
+    static std::vector<const Backend*> supported;
+    if (!supported.empty()) return supported;
+
+#ifdef CPU_DISPATCH
+    static const Backend backends[] = {
+        { "avx512", 16, avx512::Transform },
+        { "avx2", 8, avx2::Transform },
+        { "sse2", 4, sse2::Transform }
+    };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) supported.push_back(&backends[0]);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        supported.push_back(&backends[1]);
+    if (__builtin_cpu_supports("sse2")) supported.push_back(&backends[2]);
+#endif
+
+    supported.push_back(&scalar);
+    return supported;
+}
+
+/* The backend in use, if not the widest (see CpuUseISA). */
+static const Backend *selected = 0;
+
+static const Backend& Select()
+{
+    return selected ? *selected : *Supported().front();
+}
+
+const char* CpuISA()
+{
+    return Select().name;
+}
+
+std::vector<std::string> CpuISAs()
+{
+    std::vector<std::string> names;
+    for (size_t t = 0; t < Supported().size(); ++t)
+        names.push_back(Supported()[t]->name);
+    return names;
+}
+
+bool CpuUseISA(const std::string &name)
+{
+    if (name.empty())
+    {
+        selected = 0;
+        return true;
+    }
+
+    for (size_t t = 0; t < Supported().size(); ++t)
+        if (name == Supported()[t]->name)
+        {
+            selected = Supported()[t];
+            return true;
+        }
+
+    return false;
+}
+
+/* Returns the number of NUMA nodes online (as "0-1,3" in sysfs), or one if
+ * that is not known. */
+static int Nodes()
+{
+    int count = 0;
+#ifdef __linux__
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (!file) return 1;
+
+    char line[256] = "";
+    if (!fgets(line, sizeof(line), file)) line[0] = 0;
+    fclose(file);
+
+    for (char *p = line, *end = 0; *p; p = end + 1)
+    {
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) break;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        count += (int)(last - first + 1);
+        if (*end != ',') break;
+    }
+#endif
+
+    return count > 0 ? count : 1;
+}
+
+int CpuSetup(bool pin, const std::string &mode)
+{
+    if (mode == "Off") hugePages = HUGE_OFF;
+    else if (mode == "Explicit") hugePages = HUGE_EXPLICIT;
+    else hugePages = HUGE_TRANSPARENT;
+
+    nodes = Nodes();
+    cpus.clear();
+
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+
+#if defined(__linux__) && defined(_OPENMP)
+    if (!pin || getenv("OMP_PROC_BIND") || getenv("GOMP_CPU_AFFINITY"))
+        return threads;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return threads;
+
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &allowed)) cpus.push_back(c);
+
+    /* The master thread is only pinned while transforming (see Pin), since
+     * the threads the OpenCL runtime starts later inherit its affinity. */
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        if (t > 0)
+        {
+            cpu_set_t own;
+            CPU_ZERO(&own);
+            CPU_SET(cpus[t % cpus.size()], &own);
+            sched_setaffinity(0, sizeof(own), &own);
+        }
+    }
+#else
+    (void)pin;
+#endif
+
+    return threads;
+}
+
+int CpuNodes()
+{
+    return nodes;
+}
+
+/* Pins the calling (master) thread to the first CPU while in scope, if the
+ * threads are pinned, restoring its affinity afterwards. The master does the
+ * first chunk of every parallel loop, so it must stay on the node where its
+ * chunk was placed just like the other threads. */
+struct Pin
+{
+#ifdef __linux__
+    cpu_set_t saved;
+    bool pinned;
+
+    Pin() : pinned(false)
+    {
+        if (cpus.empty()) return;
+        if (sched_getaffinity(0, sizeof(saved), &saved) != 0) return;
+
+        cpu_set_t own;
+        CPU_ZERO(&own);
+        CPU_SET(cpus[0], &own);
+        pinned = sched_setaffinity(0, sizeof(own), &own) == 0;
+    }
+
+    ~Pin()
+    {
+        if (pinned) sched_setaffinity(0, sizeof(saved), &saved);
+    }
+#endif
+};
+
+/* Returns the size to map for a buffer of the given size. */
+static size_t Mapping(size_t bytes)
+{
+    if (bytes < HUGE_PAGE) return bytes;
+    return (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+
+void* CpuAllocate(size_t bytes, bool *huge)
+{
+    if (huge) *huge = false;
+
+#ifdef _WIN32
+    return _aligned_malloc(bytes, 4096);
+#else
+    size_t size = Mapping(bytes);
+    int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    bool large = (hugePages != HUGE_OFF) && (bytes >= HUGE_PAGE);
+    void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (large && (hugePages == HUGE_EXPLICIT))
+    {
+        ptr = mmap(0, size, prot, flags | MAP_HUGETLB, -1, 0);
+        if ((ptr != MAP_FAILED) && huge) *huge = true;
+    }
+#endif
+
+    if (ptr == MAP_FAILED)
+    {
+        ptr = mmap(0, size, prot, flags, -1, 0);
+        if (ptr == MAP_FAILED) return 0;
+
+#ifdef MADV_HUGEPAGE
+        if (large && (madvise(ptr, size, MADV_HUGEPAGE) == 0) && huge)
+            *huge = true;
+#endif
+    }
+
+    return ptr;
+#endif
+}
+
+void CpuFree(void *ptr, size_t bytes)
+{
+    if (!ptr) return;
+
+#ifdef _WIN32
+    (void)bytes;
+    _aligned_free(ptr);
+#else
+    munmap(ptr, Mapping(bytes));
+#endif
+}
+
+/* Samples the placement of the planes: the thread which first touched (and
+ * transforms) each row finds the node of its first page in both planes. */
+static void Place(const float *re, const float *im, size_t dim_x,
+                  size_t dim_y, CpuPlacement &placement)
+{
+    placement.threads = 1;
+    placement.nodes = 0;
+    placement.pages = placement.local = 0;
+
+#ifdef _OPENMP
+    placement.threads = omp_get_max_threads();
+#endif
+
+#if defined(__linux__) && defined(SYS_move_pages) && defined(SYS_getcpu)
+    long pages = 0, local = 0;
+    int nodes = 0;
+
+    #pragma omp parallel for schedule(static) \
+        reduction(+:pages, local) reduction(max:nodes)
+    for (long y = 0; y < (long)dim_y; ++y)
+    {
+        unsigned cpu = 0, node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, 0) != 0) continue;
+
+        void *rows[2] = { (void*)(re + y * dim_x), (void*)(im + y * dim_x) };
+        int status[2] = { -1, -1 };
+        if (syscall(SYS_move_pages, 0, 2, rows, 0, status, 0) != 0) continue;
+
+        for (int t = 0; t < 2; ++t)
+        {
+            if (status[t] < 0) continue;
+            ++pages;
+            if (status[t] == (int)node) ++local;
+            if (status[t] + 1 > nodes) nodes = status[t] + 1;
+        }
+    }
+
+    placement.nodes = nodes;
+    placement.pages = pages;
+    placement.local = local;
+#else
+    (void)re; (void)im; (void)dim_x; (void)dim_y;
+#endif
+}
+
+void CpuTransform(float *re, float *im, size_t dim_x, size_t dim_y,
+                  CpuMethod method)
+{
+    Pin pin;
+    const Backend &backend = Select();
+    bool sixStep = method == CPU_SIX_STEP;
+
+    /* Too narrow for vectors (each pass needs a whole number of them). */
+    if ((dim_x < backend.width) || (dim_y < backend.width))
+        generic::Transform(re, im, dim_x, dim_y, sixStep);
+    else backend.transform(re, im, dim_x, dim_y, sixStep);
+}
+
+void CpuFraunhofer(const void *aperture, size_t dim_x, size_t dim_y,
+                   float lensDistance, float gain, bool half, void *image,
+                   CpuMethod method, CpuPlacement *placement)
+{
+    Pin pin;
+
+    /* Both planes, aligned to a page (so that the transposes can stream to
+     * them, see codelet.hpp). They are first touched here, by the threads
+     * which will transform their rows. */
+    size_t count = dim_x * dim_y, bytes = 2 * count * sizeof(float);
+    bool huge = false;
+    float *re = (float*)CpuAllocate(bytes, &huge);
+    if (!re) throw std::bad_alloc();
+    float *im = re + count;
+
+    #pragma omp parallel for schedule(static)
+    for (long y = 0; y < (long)dim_y; ++y)
+        for (size_t t = y * dim_x; t < (y + 1) * dim_x; ++t)
+        {
+            const cl_float4 &v = ((const cl_float4*)aperture)[t];
+            re[t] = v.s[0]; im[t] = v.s[1];
+        }
+
+    if (placement)
+    {
+        Place(re, im, dim_x, dim_y, *placement);
+        placement->huge = huge;
+    }
+
+    CpuTransform(re, im, dim_x, dim_y, method);
+
+    double norm = (double)count;
+    double scale = gain / (pow(LAMBDA * lensDistance, 2) * norm * norm);
+
+    #pragma omp parallel for schedule(static)
+    for (long y = 0; y < (long)dim_y; ++y)
+        for (size_t x = 0; x < dim_x; ++x)
+        {
+            size_t t = y * dim_x + x;
+            size_t px = (x + dim_x / 2) % dim_x, py = (y + dim_y / 2) % dim_y;
+            size_t pixel = py * dim_x + px;
+            float intensity = (float)((re[t] * re[t] + im[t] * im[t]) * scale);
+
+            /* As ENCODE in def.cl. */
+            if (half) ((cl_half*)image)[pixel] = FloatToHalf(sqrt(intensity));
+            else ((float*)image)[pixel] = intensity;
+        }
+
+    CpuFree(re, bytes);
+}
@@ -1,357 +1,994 @@
 #include <spectrum.hpp>
 #include <pugixml.hpp>
 #include <utility.hpp>
+#include <aperture.hpp>
+#include <output.hpp>
+#include <profile.hpp>
+#include <outofcore.hpp>
+#include <chirp.hpp>
+#include <planner.hpp>
+#include <cpufft.hpp>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
 #include <cmath>
 
-/* These are some scene file definitions for color systems. */
-#define ID_EBU 0
-#define ID_SMPTE 1
-#define ID_HDTV 2
-#define ID_REC709 3
-#define ID_NTSC 4
-#define ID_CIE 5
-
-/* This is a color system. */
-typedef struct ColorSystem{
-    double xRed, yRed;	    	    /* Red x, y */
-    double xGreen, yGreen;  	    /* Green x, y */
-    double xBlue, yBlue;     	    /* Blue x, y */
-    double xWhite, yWhite;  	    /* White point x, y */
-	double gamma;   	    	    /* Gamma correction for system */
-} ColorSystem;
-
-/* These are some relatively common illuminants (white points). */
-#define IlluminantC     0.3101, 0.3162	    	/* For NTSC television */
-#define IlluminantD65   0.3127, 0.3291	    	/* For EBU and SMPTE */
-#define IlluminantE 	0.33333333, 0.33333333  /* CIE equal-energy illuminant */
-
-/* 0 represents a special gamma function. */
-#define GAMMA_REC709 0
-
-/* These are some standard color systems. */
-const ColorSystem /* xRed    yRed    xGreen  yGreen  xBlue  yBlue    White point        Gamma   */
-    EBUSystem    =  {0.64,   0.33,   0.29,   0.60,   0.15,   0.06,   IlluminantD65,  GAMMA_REC709},
-    SMPTESystem  =  {0.630,  0.340,  0.310,  0.595,  0.155,  0.070,  IlluminantD65,  GAMMA_REC709},
-    HDTVSystem   =  {0.670,  0.330,  0.210,  0.710,  0.150,  0.060,  IlluminantD65,  GAMMA_REC709},
-    Rec709System =  {0.64,   0.33,   0.30,   0.60,   0.15,   0.06,   IlluminantD65,  GAMMA_REC709},
-    NTSCSystem   =  {0.67,   0.33,   0.21,   0.71,   0.14,   0.08,   IlluminantC,    GAMMA_REC709},
-    CIESystem    =  {0.7355, 0.2645, 0.2658, 0.7243, 0.1669, 0.0085, IlluminantE,    GAMMA_REC709};
-
-void XYZtoRGB(float x, float y, float z, float *r, float *g, float *b, ColorSystem colorSystem)
+/* The command line and config.xml. Some of these are adjusted once the input
+ * and the device are known (to what the device supports, or to the padded
+ * size of the aperture), before any frame is rendered. */
+struct Settings
 {
-	/* Decode the color system. */
-    float xr = colorSystem.xRed;   float yr = colorSystem.yRed;   float zr = 1 - (xr + yr);
-    float xg = colorSystem.xGreen; float yg = colorSystem.yGreen; float zg = 1 - (xg + yg);
-    float xb = colorSystem.xBlue;  float yb = colorSystem.yBlue;  float zb = 1 - (xb + yb);
-    float xw = colorSystem.xWhite; float yw = colorSystem.yWhite; float zw = 1 - (xw + yw);
-
-    /* Compute the XYZ to RGB matrix. */
-    float rx = (yg * zb) - (yb * zg);
-    float ry = (xb * zg) - (xg * zb);
-    float rz = (xg * yb) - (xb * yg);
-    float gx = (yb * zr) - (yr * zb);
-    float gy = (xr * zb) - (xb * zr);
-    float gz = (xb * yr) - (xr * yb);
-    float bx = (yr * zg) - (yg * zr);
-    float by = (xg * zr) - (xr * zg);
-    float bz = (xr * yg) - (xg * yr);
-
-    /* Compute the RGB luminance scaling factor. */
-    float rw = ((rx * xw) + (ry * yw) + (rz * zw)) / yw;
-    float gw = ((gx * xw) + (gy * yw) + (gz * zw)) / yw;
-    float bw = ((bx * xw) + (by * yw) + (bz * zw)) / yw;
-
-    /* Scale the XYZ to RGB matrix to white. */
-    rx = rx / rw;  ry = ry / rw;  rz = rz / rw;
-    gx = gx / gw;  gy = gy / gw;  gz = gz / gw;
-    bx = bx / bw;  by = by / bw;  bz = bz / bw;
-
-    /* Calculate the desired RGB. */
-    *r = (rx * x) + (ry * y) + (rz * z);
-    *g = (gx * x) + (gy * y) + (gz * z);
-    *b = (bx * x) + (by * y) + (bz * z);
-
-    /* Constrain the RGB color within the RGB gamut. */
-    float w = std::min(0.0f, std::min(*r, std::min(*g, *b)));
-	*r -= w; *g -= w; *b -= w;
+    std::string input, output;
+    std::string profilePath, tracePath;
+    bool procedural, batch;
+    size_t samples;
+
+    ProceduralAperture shape;
+    Aberration aberration;
+    std::string opdPath;
+    float opdScale;
+    float endRadius, endRotation;
+    size_t pla_num, dev_num;
+    size_t frames;
+    size_t proc_dim;
+    size_t oversample;
+    size_t bands;
+    float lensDistance;
+    float apertureSize;
+    bool fresnel;
+    bool cpu, cpuPin;
+    float threshold;
+    cl_uint symmetry;
+    bool fullPlane;
+    bool half;
+    bool wide;
+    bool stockham;
+    std::string algorithm, wisdomPath;
+    std::string outOfCoreMode, scratchPath;
+    std::string hugePages, cpuTransform;
+    size_t blockBudget;
+};
+
+/* Everything set up once and resident on the device for all frames, which
+ * only regenerate (or reload) the aperture and rerun the kernels. Out of
+ * core, dim_x and dim_y are the size of the decimated Fraunhofer image, and
+ * full_x and full_y that of the aperture. */
+struct Renderer
+{
+    size_t dim_x, dim_y, radix_x, radix_y;
+    size_t full_x, full_y;
+    size_t size;                /* Of the aperture, in FFT elements. */
+    size_t tiles, images, pixel;
+    bool aberrated, chirp, outOfCore, wedge;
+    cl_uint order;
+    CpuMethod cpuMethod;
+    double transmission;
+    Bounds bounds;
+    CLParams clParams;
+
+    cl::Device device;
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Program program;
+
+    OutOfCore ooc;
+    HostBuffer aperture, output;
+    cl::Buffer brtx, brty, clAperture;
+    cl::Buffer chirpx, chirpy, scratch;
+    cl::Buffer opd, render;
+    cl::Image2D diff, spectrum;
+    std::vector<char> cpuImage;
+    std::vector<std::string> inputs, outputs;
+
+    cl::Kernel generator, kernel_x, kernel_y, chirp_x, chirp_y, pupil;
+    cl::Kernel lens, replicate;
+    size_t lensItems;
+};
+
+/* Reads the command line and config.xml, returning false if either is not
+ * valid. */
+static bool ReadSettings(int argc, char* argv[], Settings &s)
+{
+    if (argc < 4) return false;
+
+    /* Options follow the three positional arguments. */
+    for (int t = 4; t < argc; ++t)
+    {
+        std::string option = argv[t];
+        if ((option == "--profile") && (t + 1 < argc))
+            s.profilePath = argv[++t];
+        else if ((option == "--trace") && (t + 1 < argc))
+            s.tracePath = argv[++t];
+        else return false;
+    }
+
+    s.input = argv[1]; s.output = argv[2];
+    s.procedural = s.input == "procedural";
+    s.batch = s.input == "batch";
+    ProceduralAperture &shape = s.shape;
+    Aberration &aberration = s.aberration;
+
+    std::fstream xml("config.xml", std::ios::in);
+    pugi::xml_document doc; doc.load(xml);
+
+    pugi::xml_node node = doc.child("Settings");
+    s.pla_num      = node.child("OpenCL").attribute("Platform").as_uint();
+    s.dev_num      = node.child("OpenCL").attribute("Device").as_uint();
+    s.lensDistance = node.child("FFT").attribute("LensDistance").as_float();
+    s.threshold    = node.child("FFT").attribute("Threshold").as_float();
+    s.oversample   = node.child("FFT").attribute("Oversample").as_uint(1);
+    s.bands        = node.child("FFT").attribute("Bands").as_uint(0);
+    s.apertureSize = node.child("FFT").attribute("ApertureSize")
+                                      .as_float(0.01f);
+    s.fresnel = std::string(node.child("FFT").attribute("Propagation")
+                                .as_string("Fraunhofer")) == "Fresnel";
+    s.wide = std::string(node.child("FFT").attribute("Precision")
+                             .as_string("Single")) == "Double";
+    s.algorithm  = node.child("FFT").attribute("Algorithm")
+                                    .as_string("CooleyTukey");
+    s.wisdomPath = node.child("FFT").attribute("Wisdom")
+                                    .as_string("wisdom.xml");
+    s.stockham = s.algorithm == "Stockham";
+    s.cpu = std::string(node.child("FFT").attribute("Backend")
+                            .as_string("Device")) == "CPU";
+    s.symmetry   = node.child("Aperture").attribute("Symmetry").as_uint();
+    s.fullPlane  = node.child("Aperture").attribute("FullPlane")
+                                         .as_bool(false);
+    s.half = std::string(node.child("Storage").attribute("Precision")
+                             .as_string("Float")) == "Half";
+
+    s.cpuPin    = node.child("CPU").attribute("Pin").as_bool(true);
+    s.hugePages = node.child("CPU").attribute("HugePages")
+                                   .as_string("Transparent");
+    s.cpuTransform = node.child("CPU").attribute("Transform")
+                                      .as_string("Auto");
+
+    pugi::xml_node ooc = node.child("OutOfCore");
+    s.outOfCoreMode = ooc.attribute("Mode").as_string("Auto");
+    s.scratchPath   = ooc.attribute("Scratch").as_string();
+    s.blockBudget   = (size_t)ooc.attribute("Memory").as_uint() << 20;
+
+    pugi::xml_node proc = node.child("Procedural");
+    s.proc_dim          = proc.attribute("Resolution").as_uint(1024);
+    shape.blades        = proc.attribute("Blades").as_uint();
+    shape.radius        = proc.attribute("Radius").as_float(0.1f);
+    shape.rotation      = proc.attribute("Rotation").as_float();
+    shape.roundness     = proc.attribute("Roundness").as_float();
+    shape.obstruction   = proc.attribute("Obstruction").as_float();
+    shape.vanes         = proc.attribute("Vanes").as_uint();
+    shape.vaneWidth     = proc.attribute("VaneWidth").as_float();
+    shape.dust          = proc.attribute("Dust").as_float();
+    shape.dustSize      = proc.attribute("DustSize").as_float(0.01f);
+    shape.seed          = proc.attribute("Seed").as_uint();
+    shape.supersampling = proc.attribute("Supersampling").as_uint(4);
+
+    pugi::xml_node ab = node.child("Aberration");
+    aberration.radius       = ab.attribute("Radius")
+                                .as_float(s.procedural ? shape.radius : 0.5f);
+    aberration.defocus      = ab.attribute("Defocus").as_float();
+    aberration.astigmatismX = ab.attribute("AstigmatismX").as_float();
+    aberration.astigmatismY = ab.attribute("AstigmatismY").as_float();
+    aberration.comaX        = ab.attribute("ComaX").as_float();
+    aberration.comaY        = ab.attribute("ComaY").as_float();
+    aberration.spherical    = ab.attribute("Spherical").as_float();
+    s.opdPath               = ab.attribute("Map").as_string();
+    s.opdScale              = ab.attribute("MapScale").as_float(100);
+
+    pugi::xml_node seq = node.child("Sequence");
+    s.frames      = std::max(1u, seq.attribute("Frames").as_uint(1));
+    s.endRadius   = seq.attribute("Radius").as_float(shape.radius);
+    s.endRotation = seq.attribute("Rotation").as_float(shape.rotation);
+
+    if (s.lensDistance == 0.0f) return false;
+    if (!s.oversample || (s.oversample & (s.oversample - 1))) return false;
+
+    if ((shape.dust > 0) && !(shape.dustSize > 0))
+    {
+        std::cout << "DustSize must be positive" << std::endl;
+        return false;
+    }
+
+    if (shape.dust > MAX_DUST)
+    {
+        std::cout << "Dust must be at most " << MAX_DUST;
+        std::cout << " (a speck in every cell)" << std::endl;
+        return false;
+    }
+
+    /* Each pixel's sum is divided by it (see accumulate in lens.cl). */
+    if (atoi(argv[3]) < 1)
+    {
+        std::cout << "The number of passes must be positive" << std::endl;
+        return false;
+    }
+
+    s.samples = atoi(argv[3]);
+    return true;
 }
 
-cl::Program LoadProgram(cl::Context context, std::vector<cl::Device> devices)
+/* Reads the batch list, if any, and the PPM header of the aperture (or of the
+ * first of the batch), whose pixels go straight into the aperture buffer once
+ * it has been created, without any intermediate copy. Sets the size of the
+ * FFT, and rescales the lengths of the settings to it. */
+static bool OpenInput(Settings &s, Profile &profile, std::fstream &stream,
+                      PPMHeader &header, Renderer &r)
 {
-    const char* src = "#include <def.cl>\n"
-                      "#include <fft.cl>\n"
-                      "#include <lens.cl>\n";
+    /* A batch is a list of apertures of the same size, one per line along
+     * with the path of its render, which are transformed and rendered in as
+     * few launches as possible (see cl_fft_col). */
+    if (s.batch)
+    {
+        std::fstream list(s.output.c_str(), std::ios::in);
+        std::string input, output;
+        while (list >> input >> output)
+        {
+            r.inputs.push_back(input);
+            r.outputs.push_back(output);
+        }
 
-    cl::Program::Sources data;
-    data = cl::Program::Sources(1, std::make_pair(src, strlen(src)));
+        if (r.inputs.empty()) return false;
+    }
 
-    cl::Program program = cl::Program(context, data, 0);
+    if (s.procedural)
+    {
+        /* The aperture is generated on the device, nothing to read here. */
+        r.dim_x = r.dim_y = s.proc_dim * s.oversample;
+        if ((r.radix_x = r.radix_y = radix(r.dim_x)) == 0) return false;
 
-    if (program.build(devices, "-cl-std=CL1.1 -I cl/") != CL_SUCCESS)
+        /* Lengths are relative to the (now padded) width. */
+        s.shape.radius /= s.oversample;
+        s.endRadius /= s.oversample;
+    }
+    else
     {
-        std::string log;
-        program.getBuildInfo(devices[0], CL_PROGRAM_BUILD_LOG, &log);
-        std::cout << log << std::endl;
+        double start = Seconds();
+        std::string path = s.batch ? r.inputs[0] : s.input;
+        stream.open(path.c_str(), std::ios::in | std::ios::binary);
+        if (!ReadHeader(stream, header)) return false;
+        ProfileHost(profile, "header", -1, start, Seconds());
+        r.dim_x = header.dim_x * s.oversample; r.radix_x = radix(r.dim_x);
+        r.dim_y = header.dim_y * s.oversample; r.radix_y = radix(r.dim_y);
     }
 
-    return program;
+    const Aberration &a = s.aberration;
+    s.aberration.radius /= s.oversample;
+    r.aberrated = !s.opdPath.empty() || (a.defocus != 0)
+               || (a.astigmatismX != 0) || (a.astigmatismY != 0)
+               || (a.comaX != 0) || (a.comaY != 0) || (a.spherical != 0);
+    return true;
 }
 
-int main(int argc, char* argv[])
+/* Opens the device of the settings, and builds the program for them (with
+ * the FFT algorithm picked by the planner, if it is to choose). Double
+ * precision falls back to single on devices without it. */
+static bool OpenDevice(Settings &s, Profile &profile, Renderer &r)
 {
-    if (argc != 4) return 0;
-    size_t pla_num, dev_num;
-    float lensDistance;
-    float threshold;
+    std::vector<cl::Platform> platforms; cl::Platform::get(&platforms);
+    if (s.pla_num >= platforms.size()) return false;
+    cl::Platform platform = platforms[s.pla_num];
+
+    std::vector<cl::Device> devices;
+    platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    if (s.dev_num >= devices.size()) return false;
+    r.device = devices[s.dev_num];
+
+    std::string extensions;
+    r.device.getInfo(CL_DEVICE_EXTENSIONS, &extensions);
+    if (s.wide && (extensions.find("cl_khr_fp64") == std::string::npos))
+    {
+        std::cout << "No double precision support, ";
+        std::cout << "using a single precision FFT" << std::endl;
+        s.wide = false;
+    }
 
+    devices.assign(1, r.device);
+    r.context = cl::Context(devices, 0, 0, 0, 0);
+    cl_command_queue_properties properties = 0;
+    if (profile.enabled) properties |= CL_QUEUE_PROFILING_ENABLE;
+    r.queue = cl::CommandQueue(r.context, r.device, properties);
+
+    /* The fastest algorithm is picked by the planner (see planner.hpp),
+     * unless one is given. */
+    if (s.algorithm == "Auto")
     {
-        std::fstream xml("config.xml", std::ios::in);
-        pugi::xml_document doc; doc.load(xml);
+        double start = Seconds();
+        Plan plan = PlanFFT(r.context, r.device, r.dim_x, r.dim_y, s.wide,
+                            s.wisdomPath);
+        s.stockham = plan.algorithm == "Stockham";
+        ProfileHost(profile, "plan", -1, start, Seconds());
+        std::cout << "Using the " << plan.algorithm << " FFT";
+        std::cout << std::endl;
+    }
 
-        pugi::xml_node node = doc.child("Settings");
-        pla_num      = node.child("OpenCL").attribute("Platform").as_uint();
-        dev_num      = node.child("OpenCL").attribute("Device").as_uint();
-        lensDistance = node.child("FFT").attribute("LensDistance").as_float();
-        threshold    = node.child("FFT").attribute("Threshold").as_float();
+    double start = Seconds();
+    std::string options;
+    if (s.half) options += "-D HALF_STORAGE ";
+    if (s.wide) options += "-D DOUBLE_FFT ";
+    if (s.stockham) options += "-D STOCKHAM ";
 
-        if (lensDistance == 0.0f) return 0;
+    /* The Fresnel chirp rate (see fft.cl) is pi p^2 / (LAMBDA z), with
+     * p the width of a pixel of the aperture and z the lens distance. */
+    if (s.fresnel)
+    {
+        double pitch = s.apertureSize / (r.dim_x / s.oversample);
+        double rate = M_PI * pitch * pitch
+                    / (LAMBDA * 1e-9 * s.lensDistance);
+        char define[64];
+        sprintf(define, "-D FRESNEL=%.9e%s ", rate, s.wide ? "" : "f");
+        options += define;
+
+        /* Past a slope of pi radians per pixel, the chirp aliases. */
+        if (rate * r.dim_x / s.oversample > M_PI)
+        {
+            std::cout << "The Fresnel chirp is undersampled at the ";
+            std::cout << "edge of the aperture, use a smaller ";
+            std::cout << "ApertureSize or a larger LensDistance";
+            std::cout << std::endl;
+        }
     }
 
-    std::vector<cl_float4> aperture;
-    size_t samples = atoi(argv[3]);
-    size_t dim_x = 0, radix_x = 0;
-    size_t dim_y = 0, radix_y = 0;
+    r.program = LoadProgram(r.context, devices, options);
+    ProfileHost(profile, "build", -1, start, Seconds());
+    return true;
+}
 
+/* Decides how the aperture is transformed, given what fits on the device:
+ * in or out of core, in bands or not, on the device or the CPU, and in how
+ * many tiles per launch for a batch. Returns false if the settings cannot
+ * be rendered on this device at all. */
+static bool PlanRender(Settings &s, Profile &profile, Renderer &r)
+{
+    /* Apertures which do not fit on the device are transformed out of core
+     * (see outofcore.hpp), and everything after the FFT then works on their
+     * decimated Fraunhofer image, so dim_x and dim_y become its size. */
+    size_t element = s.wide ? sizeof(cl_double4) : sizeof(cl_float4);
+    r.size = r.dim_x * r.dim_y * element;
+    r.full_x = r.dim_x; r.full_y = r.dim_y;
+    size_t size = r.size;
+
+    cl_ulong maxAlloc = 0;
+    size_t maxWidth = 0, maxHeight = 0;
+    r.device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxAlloc);
+    r.device.getInfo(CL_DEVICE_IMAGE2D_MAX_WIDTH, &maxWidth);
+    r.device.getInfo(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &maxHeight);
+    r.outOfCore = (s.outOfCoreMode == "Always") || (size > maxAlloc)
+               || (r.dim_x > maxWidth) || (r.dim_y > maxHeight);
+
+    if (s.fresnel && r.outOfCore)
     {
-        std::fstream stream(argv[1], std::ios::in | std::ios::binary);
-        std::string header; stream >> header;
-        size_t resolution = 0;
+        std::cout << "Fresnel propagation needs the whole aperture ";
+        std::cout << "on the device" << std::endl;
+        return false;
+    }
 
-        if ((header != "P3") && (header != "P6")) return 0;
-        stream >> dim_x; if ((radix_x = radix(dim_x)) == 0) return 0;
-        stream >> dim_y; if ((radix_y = radix(dim_y)) == 0) return 0;
-        aperture.reserve(dim_x * dim_y);
-        stream >> resolution;
+    /* A pupil with phase aberrations has a different pattern at each band,
+     * not just a rescaled one, so each band is a tile of its own (see
+     * cl_pupil), all transformed at once. */
+    if (r.aberrated && (r.outOfCore || s.batch))
+    {
+        std::cout << "Aberrations need the whole aperture on the device, ";
+        std::cout << "and are not supported in batches" << std::endl;
+        return false;
+    }
 
-        for (size_t y = 0; y < dim_y; ++y)
-            for (size_t x = 0; x < dim_x; ++x)
-            {
-                float R, G, B, A;
-
-                if (header == "P3")
-                {
-                    size_t r, g, b;
-                    stream >> r;
-                    stream >> g;
-                    stream >> b;
-
-                    R = (float)r / resolution;
-                    G = (float)g / resolution;
-                    B = (float)b / resolution;
-                }
-                else
-                {
-                    if (resolution < 256)
-                    {
-                        uint8_t r, g, b;
-                        stream.read((char*)&r, sizeof(uint8_t));
-                        stream.read((char*)&g, sizeof(uint8_t));
-                        stream.read((char*)&b, sizeof(uint8_t));
-
-                        R = (float)r / resolution;
-                        G = (float)g / resolution;
-                        B = (float)b / resolution;
-                    }
-                    else
-                    {
-                        uint16_t r, g, b;
-                        stream.read((char*)&r, sizeof(uint16_t));
-                        stream.read((char*)&g, sizeof(uint16_t));
-                        stream.read((char*)&b, sizeof(uint16_t));
-
-                        R = (float)r / resolution;
-                        G = (float)g / resolution;
-                        B = (float)b / resolution;
-                    }
-                }
-
-                if (threshold == 1) A = sqrt((R + G + B) / 3.0f);
-                else A = (sqrt((R + G + B) / 3.0f) > threshold) ? 1 : 0;
-                cl_float4 Aper = {{A, 0, 0, 0}};
-                aperture.push_back(Aper);
-            }
+    if (r.aberrated)
+    {
+        if (s.bands == 0) s.bands = 8;
+        s.bands = std::min(s.bands, (size_t)(maxAlloc / size));
     }
 
-    cl::Platform platform;
-    cl::Device     device;
+    /* With bands, the spectrum is evaluated at the scale of each band by the
+     * chirp-z transform (see chirp.cl), into one image per band, and the
+     * FFT needs scratch space twice the size of the aperture. */
+    if (!r.aberrated && s.bands && (r.outOfCore || (2 * size > maxAlloc)))
+    {
+        std::cout << "No room for the chirp-z transform, ";
+        std::cout << "using a single Fraunhofer image" << std::endl;
+        s.bands = 0;
+    }
 
+    s.bands = std::min(s.bands, (maxHeight + 1) / (r.dim_y + 1));
+    r.images = std::max(s.bands, (size_t)1);
+    r.chirp = s.bands && !r.aberrated;
+
+    /* The CPU backend (see cpufft.hpp) computes a single far-field image,
+     * which is then uploaded for the lens kernels. */
+    if (s.cpu && (r.outOfCore || s.batch || s.bands || s.fresnel))
     {
-        std::vector<cl::Platform> platforms; cl::Platform::get(&platforms);
-        if (pla_num >= platforms.size()) return 0;
-        platform = platforms[pla_num];
+        std::cout << "The CPU FFT only does single far-field images, ";
+        std::cout << "using the device" << std::endl;
+        s.cpu = false;
+    }
 
-        std::vector<cl::Device> devices;
-        platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-        if (dev_num >= devices.size()) return 0;
-        device = devices[dev_num];
+    if (s.cpu && s.wide)
+    {
+        std::cout << "The CPU FFT is single precision only, ";
+        std::cout << "using the device" << std::endl;
+        s.cpu = false;
     }
 
-    cl::CommandQueue queue;
-    cl::Context context;
-    cl::Program program;
-    cl::Image2D diff;
+    /* Whether the CPU FFT transforms its columns in place or in six steps
+     * is measured like the device's algorithm, unless it is given. */
+    r.cpuMethod = CPU_COLUMNS;
+
+    if (s.cpu)
+    {
+        int threads = CpuSetup(s.cpuPin, s.hugePages);
+
+        /* Columns done in place cross nodes, see cpufft.hpp. */
+        if ((s.cpuTransform == "Auto") && (CpuNodes() > 1))
+            s.cpuTransform = "SixStep";
+
+        if (s.cpuTransform == "Auto")
+        {
+            double start = Seconds();
+            Plan plan = PlanCpuFFT(r.dim_x, r.dim_y, threads, s.wisdomPath);
+            s.cpuTransform = plan.algorithm;
+            ProfileHost(profile, "plan_cpu", -1, start, Seconds());
+        }
 
+        if (s.cpuTransform == "SixStep") r.cpuMethod = CPU_SIX_STEP;
+        std::cout << "CPU FFT (" << CpuISA() << ", " << threads;
+        std::cout << " threads, " << s.cpuTransform << ")" << std::endl;
+    }
+
+    /* As many apertures of a batch as the device can hold are stacked into
+     * the buffers, their images into an atlas (with a row between them). */
+    r.tiles = 1;
+
+    if (s.batch)
     {
-        std::vector<cl::Device> devices(&device, &device + 1);
-        context = cl::Context(devices, 0, 0, 0, 0);
-        queue = cl::CommandQueue(context, device, 0);
-        program = LoadProgram(context, devices);
+        if (r.outOfCore)
+        {
+            std::cout << "Batches must fit on the device" << std::endl;
+            return false;
+        }
+
+        r.tiles = std::min((size_t)(maxAlloc / (s.bands ? 2 * size : size)),
+                           (maxHeight + 1) / (r.images * (r.dim_y + 1)));
+        r.tiles = std::min(r.tiles, r.inputs.size());
+        std::cout << "Batch of " << r.inputs.size() << " apertures, ";
+        std::cout << r.tiles << " per launch" << std::endl;
     }
 
+    if (r.outOfCore)
     {
-        CLParams clParams = { (uint32_t)dim_x, (uint32_t)radix_x,
-                              (uint32_t)dim_y, (uint32_t)radix_y };
+        if (!PlanOutOfCore(r.context, r.device, r.program, r.dim_x, r.dim_y,
+                           element, s.blockBudget, 1, s.stockham,
+                           s.scratchPath, r.ooc))
+            return false;
+
+        r.dim_x /= r.ooc.factor; r.radix_x = radix(r.dim_x);
+        r.dim_y /= r.ooc.factor; r.radix_y = radix(r.dim_y);
+        std::cout << "Out of core FFT, " << r.ooc.rows << " rows and ";
+        std::cout << r.ooc.cols << " columns per block, image decimated by ";
+        std::cout << r.ooc.factor << std::endl;
+    }
+
+    CLParams clParams = { (uint32_t)r.dim_x, (uint32_t)r.radix_x,
+                          (uint32_t)r.dim_y, (uint32_t)r.radix_y };
+    r.clParams = clParams;
+    return true;
+}
+
+/* Creates the buffers and images, and reads the aperture (unless it is
+ * procedural, or a batch, which is read a launch at a time) and the optical
+ * path difference map into them. */
+static bool CreateBuffers(const Settings &s, Profile &profile,
+                          std::fstream &stream, const PPMHeader &header,
+                          Renderer &r)
+{
+    size_t dim_x = r.dim_x, dim_y = r.dim_y, size = r.size;
+
+    /* Buffers accessed by the host are mapped rather than read or written,
+     * see HostBuffer. Only PPM apertures are ever written from the host. */
+    cl_bool unified = CL_FALSE;
+    r.device.getInfo(CL_DEVICE_HOST_UNIFIED_MEMORY, &unified);
 
+    /* The Stockham FFT needs no reversal tables (the kernels get null). */
+    if (!r.outOfCore && !s.stockham)
+    {
         uint32_t *reversal_x = new uint32_t[dim_x];
         uint32_t *reversal_y = new uint32_t[dim_y];
-        ReversalTable(dim_x, radix_x, reversal_x);
-        ReversalTable(dim_y, radix_y, reversal_y);
+        ReversalTable(dim_x, r.radix_x, reversal_x);
+        ReversalTable(dim_y, r.radix_y, reversal_y);
 
-        cl::NDRange offset(0);
-        void *ptr = &aperture[0];
         size_t brt_x_size = sizeof(uint32_t) * dim_x;
         size_t brt_y_size = sizeof(uint32_t) * dim_y;
-        size_t size = dim_x * dim_y * sizeof(cl_float4);
         cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR;
-        cl::Buffer clAperture = cl::Buffer(context, flags, size, ptr);
-        cl::Buffer brtx = cl::Buffer(context, flags, brt_x_size, reversal_x);
-        cl::Buffer brty = cl::Buffer(context, flags, brt_y_size, reversal_y);
-
-        cl::Kernel kernel_x = cl::Kernel(program, "cl_fft_row");
-        kernel_x.setArg(1, sizeof(clParams), &clParams);
-        kernel_x.setArg(0, clAperture);
-        kernel_x.setArg(2, brtx);
-
-        cl::NDRange global_x(dim_y);
-        queue.enqueueNDRangeKernel(kernel_x, offset, global_x, cl::NullRange);
-
-        cl::Kernel kernel_y = cl::Kernel(program, "cl_fft_col");
-        kernel_y.setArg(1, sizeof(clParams), &clParams);
-        kernel_y.setArg(0, clAperture);
-        kernel_y.setArg(2, brty);
-
-        cl::NDRange global_y(dim_x);
-        queue.enqueueNDRangeKernel(kernel_y, offset, global_y, cl::NullRange);
-
-        flags = CL_MEM_WRITE_ONLY;
-        cl::ImageFormat format(CL_INTENSITY, CL_FLOAT);
-        cl::Image2D tmp = cl::Image2D(context, flags, format, dim_x, dim_y, 0);
-
-        flags = CL_MEM_READ_ONLY;
-        diff = cl::Image2D(context, flags, format, dim_x, dim_y, 0);
-
-        cl::Kernel kernel = cl::Kernel(program, "cl_fft_normalize");
-        kernel.setArg(3, sizeof(cl_float), &lensDistance);
-        kernel.setArg(1, sizeof(clParams), &clParams);
-        kernel.setArg(0, clAperture);
-        kernel.setArg(2, tmp);
-
-        cl::NDRange global_xy(dim_x * dim_y);
-        queue.enqueueNDRangeKernel(kernel, offset, global_xy, cl::NullRange);
-        
-        cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
-        cl::size_t<3> rgn; rgn[0] = dim_x; rgn[1] = dim_y; rgn[2] = 1;
-        queue.enqueueCopyImage(tmp, diff, origin, origin, rgn);
+        r.brtx = cl::Buffer(r.context, flags, brt_x_size, reversal_x);
+        r.brty = cl::Buffer(r.context, flags, brt_y_size, reversal_y);
 
         delete[] reversal_x;
         delete[] reversal_y;
     }
 
-    for (size_t t = 0; t < dim_x * dim_y; ++t)
+    if (!r.outOfCore)
+    {
+        /* A procedural aperture stays on the device, unless the CPU FFT
+         * reads it back. */
+        size_t pupils = r.aberrated ? s.bands : r.tiles;
+        if (s.procedural && !s.cpu)
+            r.clAperture = cl::Buffer(r.context, CL_MEM_READ_WRITE,
+                                      size * pupils);
+        else
+        {
+            r.aperture = CreateHostBuffer(r.context, size * pupils, unified);
+            r.clAperture = r.aperture.buffer;
+        }
+    }
+
+    /* Each row and column has its own scratch space (see cl_chirp_row). */
+    if (r.chirp)
     {
-        aperture[t].s[0] = 0.0f;
-        aperture[t].s[1] = 0.0f;
-        aperture[t].s[2] = 0.0f;
-        aperture[t].s[3] = 0.0f;
+        r.chirpx = ChirpTable(r.context, dim_x, s.bands, s.wide);
+        r.chirpy = ChirpTable(r.context, dim_y, s.bands, s.wide);
+        r.scratch = cl::Buffer(r.context, CL_MEM_READ_WRITE,
+                               2 * size * r.tiles);
     }
 
-    size_t size = dim_x * dim_y * sizeof(cl_float4);
-    cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR;
-    cl::Buffer render = cl::Buffer(context, flags, size, &aperture[0]);
+    /* Only the part of the FFT covering the bounds is done (see fft.cl). */
+    Bounds bounds = { 0, 0, r.full_x, r.full_y };
+    r.bounds = bounds;
+    r.transmission = 0;
 
+    if (!s.procedural && !s.batch)
     {
-        CLParams clParams = { (uint32_t)dim_x, (uint32_t)radix_x,
-                              (uint32_t)dim_y, (uint32_t)radix_y };
+        /* Out of core, the PPM is read straight into the scratch area. */
+        double start = Seconds();
+        void *ptr = r.outOfCore ? r.ooc.scratch
+                                : MapHostBuffer(r.queue, r.aperture,
+                                                CL_MAP_WRITE);
+        r.transmission = ReadPaddedAperture(stream, header, s.threshold,
+                                            s.wide, ptr, r.full_x, r.full_y,
+                                            r.bounds);
+        ProfileHost(profile, "parse", -1, start, Seconds());
+
+        if (!r.outOfCore)
+            UnmapHostBuffer(r.queue, r.aperture, CL_MAP_WRITE, ptr,
+                            ProfileDevice(profile, "upload", -1));
+    }
 
+    stream.close();
+
+    /* The optical path difference map is padded like the aperture, and is
+     * all zeros without one (the Zernike terms are added by cl_pupil). */
+    if (r.aberrated)
+    {
+        std::vector<float> field(dim_x * dim_y, 0.0f);
+
+        if (!s.opdPath.empty())
+        {
+            std::fstream map(s.opdPath.c_str(),
+                             std::ios::in | std::ios::binary);
+            PPMHeader opdHeader;
+            if (!ReadHeader(map, opdHeader) || (opdHeader.dim_x > dim_x)
+                || (opdHeader.dim_y > dim_y)) return false;
+            ReadPaddedOPD(map, opdHeader, s.opdScale, &field[0],
+                          dim_x, dim_y);
+        }
+
+        cl_mem_flags flags = CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR;
+        r.opd = cl::Buffer(r.context, flags, field.size() * sizeof(float),
+                           &field[0]);
+    }
+
+    /* The image is written by cl_fft_col and then read by cl_lens, which
+     * OpenCL 1.1 allows for a read-write image so long as each of these
+     * kernels only ever accesses it one way (no intermediate copy). */
+    cl_uint type = s.half ? CL_HALF_FLOAT : CL_FLOAT;
+    cl::ImageFormat format(CL_INTENSITY, type);
+    r.diff = cl::Image2D(r.context, CL_MEM_READ_WRITE, format, dim_x,
+                         r.tiles * r.images * (dim_y + 1) - 1, 0);
+
+    if (s.cpu) r.cpuImage.resize(dim_x * dim_y * (s.half ? sizeof(cl_half)
+                                                         : sizeof(cl_float)));
+
+    r.pixel = s.half ? 4 * sizeof(cl_half) : sizeof(cl_float4);
+    size_t renderSize = dim_x * dim_y * r.pixel * r.tiles;
+    r.output = CreateHostBuffer(r.context, renderSize, unified);
+    r.render = r.output.buffer;
+
+    {
         cl::ImageFormat format(CL_RGBA, CL_FLOAT);
-        cl::Image2D spectrum = cl::Image2D(context, CL_MEM_READ_ONLY, format,
-                                           Resolution(), 1, 0);
+        r.spectrum = cl::Image2D(r.context, CL_MEM_READ_ONLY, format,
+                                 Resolution(), 1, 0);
 
         cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
         cl::size_t<3> rgn; rgn[0] = Resolution(); rgn[1] = 1; rgn[2] = 1;
-        queue.enqueueWriteImage(spectrum, CL_TRUE, origin, rgn, 0, 0, Curve());
+        r.queue.enqueueWriteImage(r.spectrum, CL_TRUE, origin, rgn, 0, 0,
+                                  Curve(), 0,
+                                  ProfileDevice(profile, "spectrum", -1));
+    }
+
+    return true;
+}
+
+/* Sets up the FFT kernels on the device (out of core, these are part of the
+ * plan), with those of the pupil or of the chirp-z transform as needed. */
+static void SetupTransform(const Settings &s, Renderer &r)
+{
+    const CLParams &clParams = r.clParams;
+    float lensDistance = s.lensDistance;
+
+    if (!r.outOfCore)
+    {
+        r.generator = cl::Kernel(r.program, "cl_aperture");
+        r.generator.setArg(1, sizeof(clParams), &clParams);
+        r.generator.setArg(0, r.clAperture);
+
+        r.kernel_x = cl::Kernel(r.program, "cl_fft_row");
+        r.kernel_x.setArg(1, sizeof(clParams), &clParams);
+        r.kernel_x.setArg(0, r.clAperture);
+        r.kernel_x.setArg(2, r.brtx);
+
+        r.kernel_y = cl::Kernel(r.program, "cl_fft_col");
+        r.kernel_y.setArg(5, sizeof(cl_float), &lensDistance);
+        r.kernel_y.setArg(1, sizeof(clParams), &clParams);
+        r.kernel_y.setArg(0, r.clAperture);
+        r.kernel_y.setArg(2, r.brty);
+        r.kernel_y.setArg(4, r.diff);
+    }
+
+    if (r.aberrated)
+    {
+        cl_uint bandCount = s.bands;
+        r.pupil = cl::Kernel(r.program, "cl_pupil");
+        r.pupil.setArg(3, sizeof(s.aberration), &s.aberration);
+        r.pupil.setArg(1, sizeof(clParams), &clParams);
+        r.pupil.setArg(4, sizeof(cl_uint), &bandCount);
+        r.pupil.setArg(0, r.clAperture);
+        r.pupil.setArg(2, r.opd);
+    }
+
+    if (r.chirp)
+    {
+        cl_uint bandCount = s.bands;
+        r.chirp_x = cl::Kernel(r.program, "cl_chirp_row");
+        r.chirp_x.setArg(1, sizeof(clParams), &clParams);
+        r.chirp_x.setArg(0, r.clAperture);
+        r.chirp_x.setArg(3, r.scratch);
+        r.chirp_x.setArg(4, r.chirpx);
+        r.chirp_x.setArg(6, sizeof(cl_uint), &bandCount);
+
+        r.chirp_y = cl::Kernel(r.program, "cl_chirp_col");
+        r.chirp_y.setArg(7, sizeof(cl_uint), &bandCount);
+        r.chirp_y.setArg(8, sizeof(cl_float), &lensDistance);
+        r.chirp_y.setArg(1, sizeof(clParams), &clParams);
+        r.chirp_y.setArg(0, r.clAperture);
+        r.chirp_y.setArg(3, r.scratch);
+        r.chirp_y.setArg(4, r.chirpy);
+        r.chirp_y.setArg(5, r.diff);
+    }
+}
+
+/* Sets up the lens kernel, over the whole image, its right half-plane or a
+ * wedge (then filled in by cl_replicate), as the symmetry of the pattern
+ * allows. */
+static void SetupLens(const Settings &s, Renderer &r)
+{
+    /* An n-fold symmetric aperture gives a pattern of order 2n (n odd)
+     * or n (n even), which beyond 2 is rendered one wedge at a time. The
+     * doubling comes from the central symmetry of the transform of a real
+     * aperture, which the Fresnel chirp makes complex: its pattern keeps
+     * the order n of the aperture (rotations commute with the chirp), and
+     * is rendered in wedges even at order 2 and with no symmetry at all
+     * (order 1, the whole image), as is that of an aberrated pupil. The
+     * wedges are rotated in pixels, which only follows the pattern if its
+     * frequency step is the same along both axes, so a non-square image
+     * can only use a rotation by pi (order 2), if it has one. Symmetric
+     * pixels share their samples, and so their noise, so FullPlane samples
+     * every pixel on its own instead. */
+    cl_uint symmetry = s.symmetry;
+    cl_uint order = (symmetry % 2) ? 2 * symmetry : symmetry;
+    if (s.fresnel) order = std::max(symmetry, (cl_uint)1);
+    if ((order > 2) && (r.dim_x != r.dim_y)) order = (order % 2) ? 1 : 2;
+    if (r.aberrated || s.fullPlane) order = 1;
+    r.wedge = s.fresnel || (order > 2) || (order == 1);
+    r.order = order;
+
+    r.lens = cl::Kernel(r.program, r.wedge ? "cl_lens_wedge" : "cl_lens");
+    r.lens.setArg(1, sizeof(r.clParams), &r.clParams);
+    r.lens.setArg(3, r.spectrum);
+    r.lens.setArg(0, r.render);
+    r.lens.setArg(2, r.diff);
+
+    cl_uint sampleCount = s.samples, prior = 0, bandCount = s.bands;
+    cl_uint scaled = r.chirp;
+    uint64_t seed = 0;
+    r.lens.setArg(4, sizeof(cl_uint), &sampleCount);
+    r.lens.setArg(5, sizeof(uint64_t), &seed);
+    r.lens.setArg(6, sizeof(cl_uint), &prior);
+    if (r.wedge) r.lens.setArg(7, sizeof(cl_uint), &order);
+    r.lens.setArg(r.wedge ? 8 : 7, sizeof(cl_uint), &bandCount);
+    r.lens.setArg(r.wedge ? 9 : 8, sizeof(cl_uint), &scaled);
+
+    r.replicate = cl::Kernel(r.program, "cl_replicate");
+    r.replicate.setArg(1, sizeof(r.clParams), &r.clParams);
+    r.replicate.setArg(2, sizeof(cl_uint), &order);
+    r.replicate.setArg(0, r.render);
+
+    /* cl_lens only runs over the right half-plane (see lens.cl). */
+    r.lensItems = r.wedge ? r.dim_x * r.dim_y
+                          : (r.dim_x / 2 + 1) * (r.dim_y + 1);
+}
+
+/* Reads the apertures of the batch from first on into the aperture buffer,
+ * as many as it holds, returning how many. */
+static size_t LoadBatch(const Settings &s, Profile &profile, Renderer &r,
+                        size_t first, int frame)
+{
+    /* The gain of the batch is that of its brightest aperture, so that
+     * none of them overflows half storage. */
+    size_t dim_x = r.dim_x, dim_y = r.dim_y, size = r.size;
+    double parse = Seconds();
+    size_t count = std::min(r.tiles, r.inputs.size() - first);
+    char *ptr = (char*)MapHostBuffer(r.queue, r.aperture, CL_MAP_WRITE);
+    r.transmission = 0;
+    r.bounds.x0 = r.full_x; r.bounds.x1 = 0;
+    r.bounds.y0 = r.full_y; r.bounds.y1 = 0;
+
+    for (size_t t = 0; t < count; ++t)
+    {
+        std::fstream stream(r.inputs[first + t].c_str(),
+                            std::ios::in | std::ios::binary);
+        size_t ppm_x = dim_x / s.oversample, ppm_y = dim_y / s.oversample;
+        PPMHeader header;
+        if (!ReadHeader(stream, header) || (header.dim_x != ppm_x)
+            || (header.dim_y != ppm_y))
+        {
+            std::cout << "Skipping " << r.inputs[first + t];
+            std::cout << " (not " << ppm_x << "x" << ppm_y << ")";
+            std::cout << std::endl;
+            memset(ptr + t * size, 0, size);
+            continue;
+        }
+
+        Bounds tile;
+        double area = ReadPaddedAperture(stream, header, s.threshold,
+                                         s.wide, ptr + t * size,
+                                         dim_x, dim_y, tile);
+        r.transmission = std::max(r.transmission, area);
+
+        /* The window of a batch covers the bounds of every tile. */
+        r.bounds.x0 = std::min(r.bounds.x0, tile.x0);
+        r.bounds.x1 = std::max(r.bounds.x1, tile.x1);
+        r.bounds.y0 = std::min(r.bounds.y0, tile.y0);
+        r.bounds.y1 = std::max(r.bounds.y1, tile.y1);
+    }
+
+    ProfileHost(profile, "parse", frame, parse, Seconds());
+    UnmapHostBuffer(r.queue, r.aperture, CL_MAP_WRITE, ptr,
+                    ProfileDevice(profile, "upload", frame));
+    return count;
+}
 
-        cl::Kernel kernel = cl::Kernel(program, "cl_lens");
-        kernel.setArg(1, sizeof(clParams), &clParams);
-        kernel.setArg(3, spectrum);
-        kernel.setArg(0, render);
-        kernel.setArg(2, diff);
+/* Transforms the CPU backend's copy of the aperture, and uploads its image. */
+static void TransformCPU(const Settings &s, Profile &profile, Renderer &r,
+                         float gain, int frame)
+{
+    double fft = Seconds();
+    void *ptr = MapHostBuffer(r.queue, r.aperture, CL_MAP_READ,
+                              ProfileDevice(profile, "download", frame));
+    CpuPlacement placement;
+    CpuFraunhofer(ptr, r.dim_x, r.dim_y, s.lensDistance, gain, s.half,
+                  &r.cpuImage[0], r.cpuMethod,
+                  profile.enabled ? &placement : 0);
+    UnmapHostBuffer(r.queue, r.aperture, CL_MAP_READ, ptr);
+    ProfileHost(profile, "cpu_fft", frame, fft, Seconds());
+
+    if (profile.enabled)
+    {
+        size_t pages = std::max(placement.pages, (size_t)1);
+        ProfileCount(profile, "cpu_threads", placement.threads);
+        ProfileCount(profile, "cpu_nodes", placement.nodes);
+        ProfileCount(profile, "cpu_local_pages",
+                     100.0 * placement.local / pages);
+        ProfileCount(profile, "cpu_huge_pages", placement.huge);
+    }
+
+    cl::size_t<3> origin; origin[0] = origin[1] = origin[2] = 0;
+    cl::size_t<3> rgn; rgn[0] = r.dim_x; rgn[1] = r.dim_y; rgn[2] = 1;
+    cl::Event *event = ProfileDevice(profile, "image", frame);
+    r.queue.enqueueWriteImage(r.diff, CL_FALSE, origin, rgn, 0, 0,
+                              &r.cpuImage[0], 0, event);
+}
 
-		cl_uint sampleCount = samples, seed = 0;
-		kernel.setArg(4, sizeof(cl_uint), &sampleCount);
-		kernel.setArg(5, sizeof(uint64_t), &seed);
+/* Transforms count apertures (or the bands of an aberrated pupil) on the
+ * device, over the window of the bounds, in bands for the chirp-z
+ * transform. */
+static void TransformDevice(const Settings &s, Profile &profile, Renderer &r,
+                            size_t count, float gain, int frame)
+{
+    cl::NDRange offset(0), global_xy(r.dim_x * r.dim_y);
 
-        cl::NDRange offset(0), global(dim_x * dim_y);
-        queue.enqueueNDRangeKernel(kernel, offset, global, cl::NullRange);
-        queue.enqueueReadBuffer(render, CL_TRUE, 0, size, &aperture[0]);
+    /* Each band of an aberrated pupil is a tile of the FFT. */
+    size_t pupils = count;
+    if (r.aberrated)
+    {
+        cl::Event *event = ProfileDevice(profile, "pupil", frame);
+        r.queue.enqueueNDRangeKernel(r.pupil, offset, global_xy,
+                                     cl::NullRange, 0, event);
+        pupils = s.bands;
     }
 
-    std::fstream stream(argv[2], std::ios::out | std::ios::binary);
+    CLParams window = PruneWindow(r.bounds, r.clParams, s.stockham);
+    r.kernel_x.setArg(3, sizeof(window), &window);
+    r.kernel_y.setArg(3, sizeof(window), &window);
+    r.kernel_y.setArg(6, sizeof(cl_float), &gain);
+
+    /* Only the rows of the window are transformed. */
+    size_t rows = (size_t)1 << window.rad_y;
+    cl::NDRange global_x(rows * pupils), global_y(r.dim_x * pupils);
+
+    if (r.chirp)
+    {
+        /* The aperture is kept, so each band starts from it. */
+        r.chirp_x.setArg(2, sizeof(window), &window);
+        r.chirp_y.setArg(2, sizeof(window), &window);
+        r.chirp_y.setArg(9, sizeof(cl_float), &gain);
 
-    stream << "#?RADIANCE" << std::endl;
-    stream << "SOFTWARE=fraunhofer" << std::endl;
-    stream << "FORMAT=32-bit_rle_rgbe" << std::endl << std::endl;
-    stream << "-Y " << dim_y << " +X " << dim_x << std::endl;
+        for (cl_uint band = 0; band < s.bands; ++band)
+        {
+            r.chirp_x.setArg(5, sizeof(cl_uint), &band);
+            r.chirp_y.setArg(6, sizeof(cl_uint), &band);
+            cl::Event *row = ProfileDevice(profile, "chirp_row", frame);
+            r.queue.enqueueNDRangeKernel(r.chirp_x, offset, global_x,
+                                         cl::NullRange, 0, row);
+            cl::Event *col = ProfileDevice(profile, "chirp_col", frame);
+            r.queue.enqueueNDRangeKernel(r.chirp_y, offset, global_y,
+                                         cl::NullRange, 0, col);
+        }
+    }
+    else
+    {
+        cl::Event *row = ProfileDevice(profile, "fft_row", frame);
+        r.queue.enqueueNDRangeKernel(r.kernel_x, offset, global_x,
+                                     cl::NullRange, 0, row);
+        cl::Event *col = ProfileDevice(profile, "fft_col", frame);
+        r.queue.enqueueNDRangeKernel(r.kernel_y, offset, global_y,
+                                     cl::NullRange, 0, col);
+    }
+}
 
-    for (size_t y = 0; y < dim_y; ++y)
-        for (size_t x = 0; x < dim_x; ++x)
+/* Renders every frame (or every launch of a batch) and writes its images,
+ * printing the time per frame of a sequence after the startup time. */
+static void RenderFrames(const Settings &s, Profile &profile, Renderer &r,
+                         double startup)
+{
+    const ProceduralAperture &shape = s.shape;
+    cl::NDRange offset(0), global_xy(r.dim_x * r.dim_y);
+    size_t dim_x = r.dim_x, dim_y = r.dim_y;
+
+    /* Only procedural apertures can vary from one frame to the next, while
+     * each frame of a batch is one launch of (up to) tiles apertures. */
+    size_t frames = s.frames;
+    if (!s.procedural) frames = 1;
+    if (s.batch) frames = (r.inputs.size() + r.tiles - 1) / r.tiles;
+    double elapsed = 0;
+
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+        double start = Seconds();
+
+        /* Interpolate the iris from its initial to its final state. */
+        float t = (frames > 1) ? (float)frame / (frames - 1) : 0;
+        ProceduralAperture current = shape;
+        current.radius += (s.endRadius - shape.radius) * t;
+        current.rotation += (s.endRotation - shape.rotation) * t;
+        if (s.procedural)
         {
-            float a = aperture[y * dim_x + x].s[0];
-            float b = aperture[y * dim_x + x].s[1];
-            float c = aperture[y * dim_x + x].s[2];
-            float n = aperture[y * dim_x + x].s[3];
+            r.transmission = ProceduralArea(current) * r.full_x * r.full_x;
+            r.bounds = ProceduralBounds(current, r.full_x, r.full_y);
+        }
 
-            if (n != 0.0f)
+        size_t first = frame * r.tiles, count = 1;
+        if (s.batch) count = LoadBatch(s, profile, r, first, frame);
+
+        /* Half storage cannot hold the tiny absolute intensities produced by
+         * the normalized FFT, so they are stored relative to the central (DC)
+         * peak, then rescaled. The peak is the squared total transmission over
+         * the squared product of wavelength (LAMBDA) and distance, and the
+         * gain scales it to 1. */
+        float gain = 1;
+        if (s.half && (r.transmission > 0))
+            gain = pow((double)r.full_x * r.full_y / r.transmission, 2)
+                 * pow(LAMBDA * s.lensDistance, 2);
+
+        if (r.outOfCore)
+            RunOutOfCore(r.queue, r.ooc, r.diff,
+                         s.procedural ? &current : 0, s.lensDistance, gain,
+                         profile, frame);
+        else
+        {
+            if (s.procedural)
             {
-                a /= n;
-                b /= n;
-                c /= n;
+                r.generator.setArg(2, sizeof(current), &current);
+                cl::Event *event = ProfileDevice(profile, "generate", frame);
+                r.queue.enqueueNDRangeKernel(r.generator, offset, global_xy,
+                                             cl::NullRange, 0, event);
             }
 
-            a = sqrt(a);
-            b = sqrt(b);
-            c = sqrt(c);
-
-			/* This is TEMPORARY as the code is supposed to output
-			 * the render in XYZ format. However, apparently handling
-			 * XYZ colors is so mind-blowingly difficult that HDR
-			 * viewers aren't capable of doing so, so at the moment
-			 * we're outputting in RGB as a stopgap solution. */
-			XYZtoRGB(a, b, c, &a, &b, &c, CIESystem);
-
-            float m = std::max(a, std::max(b, c));
-            uint8_t pe = ceil(log(m) / log(2.0f) + 128);
-            uint8_t px = floor((256 * a) / pow(2.0f, pe - 128));
-            uint8_t py = floor((256 * b) / pow(2.0f, pe - 128));
-            uint8_t pz = floor((256 * c) / pow(2.0f, pe - 128));
-
-            stream.write((char*)&px, sizeof(uint8_t));
-            stream.write((char*)&py, sizeof(uint8_t));
-            stream.write((char*)&pz, sizeof(uint8_t));
-            stream.write((char*)&pe, sizeof(uint8_t));
+            if (s.cpu) TransformCPU(s, profile, r, gain, frame);
+            else TransformDevice(s, profile, r, count, gain, frame);
         }
 
-    stream.close();
+        /* The first lens pass writes every pixel it samples rather than
+         * accumulating, and cl_replicate writes the rest, so the render
+         * buffer is never cleared. */
+        cl::NDRange global_lens(r.lensItems * count);
+        r.queue.enqueueNDRangeKernel(r.lens, offset, global_lens,
+                                     cl::NullRange, 0,
+                                     ProfileDevice(profile, "lens", frame));
+
+        if (r.wedge && (r.order > 1))
+        {
+            cl::NDRange global_tiles(dim_x * dim_y * count);
+            cl::Event *event = ProfileDevice(profile, "replicate", frame);
+            r.queue.enqueueNDRangeKernel(r.replicate, offset, global_tiles,
+                                         cl::NullRange, 0, event);
+        }
+
+        cl::Event *readback = ProfileDevice(profile, "readback", frame);
+        char *ptr = (char*)MapHostBuffer(r.queue, r.output, CL_MAP_READ,
+                                         readback);
+
+        double encode = Seconds();
+        for (size_t t = 0; t < count; ++t)
+        {
+            std::string path = s.output;
+            if (s.batch) path = r.outputs[first + t];
+            else if (frames > 1) path = FramePath(path, frame);
+            WriteRadiance(path.c_str(), ptr + t * dim_x * dim_y * r.pixel,
+                          dim_x, dim_y, s.half, gain);
+        }
+
+        UnmapHostBuffer(r.queue, r.output, CL_MAP_READ, ptr);
+        ProfileHost(profile, "encode", frame, encode, Seconds());
+        ProfileHost(profile, "frame", frame, start, Seconds());
+
+        if (frames > 1)
+        {
+            double taken = Seconds() - start; elapsed += taken;
+            std::cout << "Frame " << frame << ": " << taken << "s" << std::endl;
+        }
+    }
+
+    if (frames > 1)
+    {
+        std::cout << "Startup: " << startup << "s, ";
+        std::cout << elapsed / frames << "s per frame" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Settings s;
+    if (!ReadSettings(argc, argv, s)) return 0;
+
+    double startup = Seconds();
+    Profile profile = CreateProfile(!s.profilePath.empty()
+                                 || !s.tracePath.empty());
+
+    Renderer r;
+    std::fstream stream;
+    PPMHeader header;
+    if (!OpenInput(s, profile, stream, header, r)) return 0;
+    if (!OpenDevice(s, profile, r)) return 0;
+    if (!PlanRender(s, profile, r)) return 0;
+    if (!CreateBuffers(s, profile, stream, header, r)) return 0;
+
+    SetupTransform(s, r);
+    SetupLens(s, r);
+    RenderFrames(s, profile, r, Seconds() - startup);
+
+    r.queue.finish();
+    if (r.outOfCore) ReleaseOutOfCore(r.ooc);
+
+    if (!s.profilePath.empty() && !WriteProfile(profile, s.profilePath))
+        std::cout << "Could not write " << s.profilePath << std::endl;
+    if (!s.tracePath.empty() && !WriteTrace(profile, s.tracePath))
+        std::cout << "Could not write " << s.tracePath << std::endl;
 }
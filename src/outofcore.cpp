@@ -0,0 +1,232 @@
+#include <outofcore.hpp>
+#include <utility.hpp>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Allocates the scratch area in host memory, or in a file mapped into it so
+ * that the aperture size is only limited by disk space. The file is unlinked
+ * once mapped, so it goes away with the process. */
+static bool AllocateScratch(OutOfCore &ooc, const std::string &path)
+{
+    ooc.mapped = !path.empty();
+
+#ifdef _WIN32
+    if (ooc.mapped)
+    {
+        std::cout << "Scratch files are not supported here, ";
+        std::cout << "using host memory" << std::endl;
+        ooc.mapped = false;
+    }
+#else
+    if (ooc.mapped)
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) return false;
+
+        void *ptr = MAP_FAILED;
+        if (ftruncate(fd, ooc.scratchSize) == 0)
+            ptr = mmap(0, ooc.scratchSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+
+        close(fd);
+        unlink(path.c_str());
+        if (ptr == MAP_FAILED) return false;
+        ooc.scratch = (char*)ptr;
+        return true;
+    }
+#endif
+
+    ooc.scratch = (char*)malloc(ooc.scratchSize);
+    return ooc.scratch != 0;
+}
+
+bool PlanOutOfCore(cl::Context context, cl::Device device, cl::Program program,
+                   size_t dim_x, size_t dim_y, size_t element, size_t budget,
+                   size_t minFactor, bool stockham,
+                   const std::string &scratchPath, OutOfCore &ooc)
+{
+    cl_ulong maxAlloc = 0, globalMem = 0;
+    size_t maxWidth = 0, maxHeight = 0;
+    device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxAlloc);
+    device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &globalMem);
+    device.getInfo(CL_DEVICE_IMAGE2D_MAX_WIDTH, &maxWidth);
+    device.getInfo(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &maxHeight);
+
+    /* The image and render buffer (of float4 at most) share the device with
+     * the block, so each of them is given a quarter of its memory. */
+    cl_ulong share = std::min(maxAlloc, globalMem / 4);
+    if (budget == 0) budget = share;
+
+    size_t factor = std::max(minFactor, (size_t)1);
+    while ((dim_x / factor > maxWidth) || (dim_y / factor > maxHeight)
+        || ((cl_ulong)(dim_x / factor) * (dim_y / factor)
+            * sizeof(cl_float4) > share))
+        factor *= 2;
+
+    size_t rows = dim_y, cols = dim_x;
+    while ((rows > 1) && (rows * dim_x * element > budget)) rows /= 2;
+    while ((cols > factor) && (cols * dim_y * element > budget)) cols /= 2;
+
+    if ((factor > std::min(dim_x, dim_y)) || (rows * dim_x * element > budget)
+        || (cols * dim_y * element > budget)) return false;
+
+    ooc.dim_x = dim_x; ooc.dim_y = dim_y;
+    ooc.factor = factor;
+    ooc.rows = rows; ooc.cols = cols;
+    ooc.element = element;
+    ooc.scratchSize = dim_x * dim_y * element;
+    if (!AllocateScratch(ooc, scratchPath)) return false;
+
+    size_t radix_x = radix(dim_x), radix_y = radix(dim_y);
+
+    if (!stockham)
+    {
+        std::vector<uint32_t> reversal_x(dim_x), reversal_y(dim_y);
+        ReversalTable(dim_x, radix_x, &reversal_x[0]);
+        ReversalTable(dim_y, radix_y, &reversal_y[0]);
+
+        cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR;
+        ooc.brtx = cl::Buffer(context, flags, sizeof(uint32_t) * dim_x,
+                              &reversal_x[0]);
+        ooc.brty = cl::Buffer(context, flags, sizeof(uint32_t) * dim_y,
+                              &reversal_y[0]);
+    }
+
+    size_t blockSize = std::max(rows * dim_x, cols * dim_y) * element;
+    ooc.block = cl::Buffer(context, CL_MEM_READ_WRITE, blockSize);
+
+    CLParams full = { (cl_uint)dim_x, (cl_uint)radix_x,
+                      (cl_uint)dim_y, (cl_uint)radix_y };
+    CLParams rowBlock = { (cl_uint)dim_x, (cl_uint)radix_x, (cl_uint)rows, 0 };
+    CLParams colBlock = { (cl_uint)cols, (cl_uint)radix_x,
+                          (cl_uint)dim_y, (cl_uint)radix_y };
+    cl_uint decimation = factor;
+
+    /* Blocks are transformed whole (the windows cover them, see fft.cl). */
+    CLParams rowWindow = { 0, (cl_uint)radix_x, 0, (cl_uint)radix(rows) };
+    CLParams colWindow = { 0, (cl_uint)radix_x, 0, (cl_uint)radix_y };
+
+    ooc.generator = cl::Kernel(program, "cl_aperture");
+    ooc.generator.setArg(0, ooc.block);
+    ooc.generator.setArg(1, sizeof(full), &full);
+
+    ooc.row = cl::Kernel(program, "cl_fft_row");
+    ooc.row.setArg(0, ooc.block);
+    ooc.row.setArg(1, sizeof(rowBlock), &rowBlock);
+    ooc.row.setArg(2, ooc.brtx);
+    ooc.row.setArg(3, sizeof(rowWindow), &rowWindow);
+
+    ooc.col = cl::Kernel(program, "cl_fft_col_block");
+    ooc.col.setArg(0, ooc.block);
+    ooc.col.setArg(1, sizeof(colBlock), &colBlock);
+    ooc.col.setArg(2, ooc.brty);
+    ooc.col.setArg(3, sizeof(colWindow), &colWindow);
+
+    ooc.power = cl::Kernel(program, "cl_fft_power");
+    ooc.power.setArg(0, ooc.block);
+    ooc.power.setArg(1, sizeof(colBlock), &colBlock);
+    ooc.power.setArg(2, sizeof(full), &full);
+    ooc.power.setArg(5, sizeof(cl_uint), &decimation);
+
+    return true;
+}
+
+void RunOutOfCore(cl::CommandQueue queue, OutOfCore &ooc, cl::Image2D image,
+                  const ProceduralAperture *shape, float lensDistance,
+                  float gain, Profile &profile, int frame)
+{
+    size_t dim_x = ooc.dim_x, dim_y = ooc.dim_y, element = ooc.element;
+    cl::NDRange offset(0);
+
+    if (shape) ooc.generator.setArg(2, sizeof(*shape), shape);
+    ooc.power.setArg(3, image);
+    ooc.power.setArg(6, sizeof(cl_float), &lensDistance);
+    ooc.power.setArg(7, sizeof(cl_float), &gain);
+
+    /* Rows: each block is uploaded (or generated), transformed and read back
+     * in place. Blocks are contiguous in the scratch area. */
+    double start = Seconds();
+    double rowBytes = 0;
+
+    for (size_t r = 0; r < dim_y; r += ooc.rows)
+    {
+        size_t bytes = ooc.rows * dim_x * element;
+        char *host = ooc.scratch + r * dim_x * element;
+
+        if (shape)
+            queue.enqueueNDRangeKernel(ooc.generator, cl::NDRange(r * dim_x),
+                                       cl::NDRange(ooc.rows * dim_x),
+                                       cl::NullRange);
+        else
+        {
+            queue.enqueueWriteBuffer(ooc.block, CL_FALSE, 0, bytes, host);
+            rowBytes += bytes;
+        }
+
+        queue.enqueueNDRangeKernel(ooc.row, offset, cl::NDRange(ooc.rows),
+                                   cl::NullRange);
+        queue.enqueueReadBuffer(ooc.block, CL_TRUE, 0, bytes, host);
+        rowBytes += bytes;
+    }
+
+    double rowTime = Seconds() - start;
+    ProfileHost(profile, "ooc_rows", frame, start, start + rowTime);
+
+    /* Columns: each block is gathered from the scratch area by a strided
+     * (rectangular) upload, transformed and reduced into the image, so it
+     * never needs to be read back. */
+    start = Seconds();
+    double colBytes = 0;
+
+    for (size_t c = 0; c < dim_x; c += ooc.cols)
+    {
+        cl::size_t<3> origin; origin[0] = 0; origin[1] = 0; origin[2] = 0;
+        cl::size_t<3> host; host[0] = c * element; host[1] = 0; host[2] = 0;
+        cl::size_t<3> rgn; rgn[0] = ooc.cols * element;
+        rgn[1] = dim_y; rgn[2] = 1;
+
+        queue.enqueueWriteBufferRect(ooc.block, CL_FALSE, origin, host, rgn,
+                                     ooc.cols * element, 0,
+                                     dim_x * element, 0, ooc.scratch);
+        colBytes += ooc.cols * dim_y * element;
+
+        cl_uint column = c;
+        ooc.power.setArg(4, sizeof(cl_uint), &column);
+        size_t pixels = (ooc.cols / ooc.factor) * (dim_y / ooc.factor);
+
+        queue.enqueueNDRangeKernel(ooc.col, offset, cl::NDRange(ooc.cols),
+                                   cl::NullRange);
+        queue.enqueueNDRangeKernel(ooc.power, offset, cl::NDRange(pixels),
+                                   cl::NullRange);
+    }
+
+    queue.finish();
+    double colTime = Seconds() - start;
+    ProfileHost(profile, "ooc_cols", frame, start, start + colTime);
+
+    printf("Rows: %.3fs (%.2f GB/s), columns: %.3fs (%.2f GB/s)\n",
+           rowTime, rowBytes / rowTime * 1e-9,
+           colTime, colBytes / colTime * 1e-9);
+}
+
+void ReleaseOutOfCore(OutOfCore &ooc)
+{
+#ifndef _WIN32
+    if (ooc.mapped)
+    {
+        munmap(ooc.scratch, ooc.scratchSize);
+        return;
+    }
+#endif
+
+    free(ooc.scratch);
+}
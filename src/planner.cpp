@@ -0,0 +1,275 @@
+#include <planner.hpp>
+#include <aperture.hpp>
+#include <cpufft.hpp>
+#include <utility.hpp>
+#include <pugixml.hpp>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <cstdio>
+
+/* Candidate plans, with the build options of each. */
+struct Candidate
+{
+    const char *algorithm;
+    const char *options;
+};
+
+static const Candidate candidates[] = {
+    { "CooleyTukey", "" },
+    { "Stockham", "-D STOCKHAM " }
+};
+
+/* Candidate plans of the CPU FFT, as CPU Transform in config.xml. */
+struct CpuCandidate
+{
+    const char *algorithm;
+    CpuMethod method;
+};
+
+static const CpuCandidate cpuCandidates[] = {
+    { "Columns", CPU_COLUMNS },
+    { "SixStep", CPU_SIX_STEP }
+};
+
+#define REPEAT 3
+
+static double Elapsed(const cl::Event &event)
+{
+    cl_ulong start = 0, end = 0;
+    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+    return (end - start) * 1e-9;
+}
+
+/* Returns the best time of a few transforms (after an untimed one) of an
+ * aperture generated on the device, with the whole of it as the window. */
+static double Time(cl::Context context, cl::Device device, const char *options,
+                   size_t dim_x, size_t dim_y, bool wide)
+{
+    std::vector<cl::Device> devices(&device, &device + 1);
+    std::string build = std::string(options) + (wide ? "-D DOUBLE_FFT " : "");
+    cl::Program program = LoadProgram(context, devices, build);
+    cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+    size_t radix_x = radix(dim_x), radix_y = radix(dim_y);
+    size_t element = wide ? sizeof(cl_double4) : sizeof(cl_float4);
+    CLParams dims = { (cl_uint)dim_x, (cl_uint)radix_x,
+                      (cl_uint)dim_y, (cl_uint)radix_y };
+    CLParams window = { 0, (cl_uint)radix_x, 0, (cl_uint)radix_y };
+
+    std::vector<uint32_t> reversal_x(dim_x), reversal_y(dim_y);
+    ReversalTable(dim_x, radix_x, &reversal_x[0]);
+    ReversalTable(dim_y, radix_y, &reversal_y[0]);
+
+    cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR;
+    cl::Buffer brtx(context, flags, sizeof(uint32_t) * dim_x, &reversal_x[0]);
+    cl::Buffer brty(context, flags, sizeof(uint32_t) * dim_y, &reversal_y[0]);
+    cl::Buffer data(context, CL_MEM_READ_WRITE, dim_x * dim_y * element);
+
+    cl::ImageFormat format(CL_INTENSITY, CL_FLOAT);
+    cl::Image2D image(context, CL_MEM_READ_WRITE, format, dim_x, dim_y, 0);
+
+    ProceduralAperture shape;
+    shape.blades = 0; shape.radius = 0.1f; shape.rotation = 0;
+    shape.roundness = 0; shape.obstruction = 0; shape.vanes = 0;
+    shape.vaneWidth = 0; shape.dust = 0; shape.dustSize = 0.01f;
+    shape.seed = 0; shape.supersampling = 1;
+
+    cl::Kernel generator(program, "cl_aperture");
+    generator.setArg(0, data);
+    generator.setArg(1, sizeof(dims), &dims);
+    generator.setArg(2, sizeof(shape), &shape);
+
+    cl_float lensDistance = 0.005f, gain = 1;
+    cl::Kernel row(program, "cl_fft_row");
+    row.setArg(0, data);
+    row.setArg(1, sizeof(dims), &dims);
+    row.setArg(2, brtx);
+    row.setArg(3, sizeof(window), &window);
+
+    cl::Kernel col(program, "cl_fft_col");
+    col.setArg(0, data);
+    col.setArg(1, sizeof(dims), &dims);
+    col.setArg(2, brty);
+    col.setArg(3, sizeof(window), &window);
+    col.setArg(4, image);
+    col.setArg(5, sizeof(cl_float), &lensDistance);
+    col.setArg(6, sizeof(cl_float), &gain);
+
+    cl::NDRange offset(0);
+    double best = 0;
+
+    for (size_t t = 0; t <= REPEAT; ++t)
+    {
+        cl::Event rows, cols;
+        queue.enqueueNDRangeKernel(generator, offset,
+                                   cl::NDRange(dim_x * dim_y), cl::NullRange);
+        queue.enqueueNDRangeKernel(row, offset, cl::NDRange(dim_y),
+                                   cl::NullRange, 0, &rows);
+        queue.enqueueNDRangeKernel(col, offset, cl::NDRange(dim_x),
+                                   cl::NullRange, 0, &cols);
+        queue.finish();
+
+        double time = Elapsed(rows) + Elapsed(cols);
+        if (t == 1) best = time;
+        else if (t > 1) best = std::min(best, time);
+    }
+
+    return best;
+}
+
+/* Looks up the plan for the given key in the wisdom file at path (if not
+ * empty), which is loaded into doc either way. Returns false if none. */
+static bool Recall(pugi::xml_document &doc, const std::string &path,
+                   const std::string &name, const std::string &driver,
+                   const char *size, const char *precision, Plan &plan)
+{
+    if (!path.empty()) doc.load_file(path.c_str());
+    pugi::xml_node wisdom = doc.child("Wisdom");
+    if (!wisdom) wisdom = doc.append_child("Wisdom");
+
+    for (pugi::xml_node node = wisdom.child("Plan"); node;
+         node = node.next_sibling("Plan"))
+    {
+        if ((name == node.attribute("Device").as_string())
+            && (driver == node.attribute("Driver").as_string())
+            && (std::string(size) == node.attribute("Size").as_string())
+            && (std::string(precision) == node.attribute("Precision")
+                                              .as_string()))
+        {
+            plan.algorithm = node.attribute("Algorithm").as_string();
+            plan.time = node.attribute("Time").as_double();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Adds the plan for the given key to doc and writes it back to path (unless
+ * it is empty). */
+static void Remember(pugi::xml_document &doc, const std::string &path,
+                     const std::string &name, const std::string &driver,
+                     const char *size, const char *precision,
+                     const Plan &plan)
+{
+    if (path.empty()) return;
+
+    pugi::xml_node node = doc.child("Wisdom").append_child("Plan");
+    node.append_attribute("Device") = name.c_str();
+    node.append_attribute("Driver") = driver.c_str();
+    node.append_attribute("Size") = size;
+    node.append_attribute("Precision") = precision;
+    node.append_attribute("Algorithm") = plan.algorithm.c_str();
+    node.append_attribute("Time") = plan.time;
+
+    if (!doc.save_file(path.c_str()))
+        std::cout << "Could not write " << path << std::endl;
+}
+
+Plan PlanFFT(cl::Context context, cl::Device device, size_t dim_x,
+             size_t dim_y, bool wide, const std::string &path)
+{
+    std::string name, driver;
+    device.getInfo(CL_DEVICE_NAME, &name);
+    device.getInfo(CL_DRIVER_VERSION, &driver);
+
+    char size[64];
+    sprintf(size, "%ux%u", (unsigned)dim_x, (unsigned)dim_y);
+    const char *precision = wide ? "Double" : "Single";
+
+    pugi::xml_document doc;
+    Plan plan;
+    if (Recall(doc, path, name, driver, size, precision, plan)) return plan;
+
+    plan.algorithm = candidates[0].algorithm;
+    plan.time = 0;
+
+    cl_ulong maxAlloc = 0;
+    size_t maxWidth = 0, maxHeight = 0;
+    device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxAlloc);
+    device.getInfo(CL_DEVICE_IMAGE2D_MAX_WIDTH, &maxWidth);
+    device.getInfo(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &maxHeight);
+    size_t element = wide ? sizeof(cl_double4) : sizeof(cl_float4);
+
+    if ((dim_x * dim_y * element > maxAlloc) || (dim_x > maxWidth)
+        || (dim_y > maxHeight)) return plan;
+
+    size_t count = sizeof(candidates) / sizeof(*candidates);
+    for (size_t t = 0; t < count; ++t)
+    {
+        double time = Time(context, device, candidates[t].options,
+                           dim_x, dim_y, wide);
+        printf("Planning %s FFT: %.3fms\n", candidates[t].algorithm,
+               time * 1e3);
+
+        if ((t > 0) && (time >= plan.time)) continue;
+        plan.algorithm = candidates[t].algorithm;
+        plan.time = time;
+    }
+
+    Remember(doc, path, name, driver, size, precision, plan);
+    return plan;
+}
+
+/* As Time, on the CPU: the planes are allocated and filled as by
+ * CpuFraunhofer, so that their pages are placed the same way. */
+static double TimeCPU(CpuMethod method, size_t dim_x, size_t dim_y)
+{
+    size_t count = dim_x * dim_y, bytes = 2 * count * sizeof(float);
+    float *re = (float*)CpuAllocate(bytes);
+    if (!re) return 0;
+    float *im = re + count;
+
+    double best = 0;
+
+    for (size_t t = 0; t <= REPEAT; ++t)
+    {
+        #pragma omp parallel for schedule(static)
+        for (long y = 0; y < (long)dim_y; ++y)
+            for (size_t x = 0; x < dim_x; ++x)
+            {
+                double u = (double)x / dim_x - 0.5, v = (double)y / dim_y - 0.5;
+                re[y * dim_x + x] = (u * u + v * v < 0.01);
+                im[y * dim_x + x] = 0;
+            }
+
+        double start = Seconds();
+        CpuTransform(re, im, dim_x, dim_y, method);
+        double time = Seconds() - start;
+
+        if (t == 1) best = time;
+        else if (t > 1) best = std::min(best, time);
+    }
+
+    CpuFree(re, bytes);
+    return best;
+}
+
+Plan PlanCpuFFT(size_t dim_x, size_t dim_y, int threads,
+                const std::string &path)
+{
+    char name[64], size[64];
+    sprintf(name, "CPU (%s, %d threads)", CpuISA(), threads);
+    sprintf(size, "%ux%u", (unsigned)dim_x, (unsigned)dim_y);
+
+    pugi::xml_document doc;
+    Plan plan;
+    if (Recall(doc, path, name, "", size, "Single", plan)) return plan;
+
+    size_t count = sizeof(cpuCandidates) / sizeof(*cpuCandidates);
+    for (size_t t = 0; t < count; ++t)
+    {
+        double time = TimeCPU(cpuCandidates[t].method, dim_x, dim_y);
+        printf("Planning %s CPU FFT: %.3fms\n", cpuCandidates[t].algorithm,
+               time * 1e3);
+
+        if ((t > 0) && (time >= plan.time)) continue;
+        plan.algorithm = cpuCandidates[t].algorithm;
+        plan.time = time;
+    }
+
+    Remember(doc, path, name, "", size, "Single", plan);
+    return plan;
+}
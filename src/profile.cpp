@@ -0,0 +1,259 @@
+#include <profile.hpp>
+#include <utility.hpp>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdio>
+
+Profile CreateProfile(bool enabled)
+{
+    Profile profile;
+    profile.enabled = enabled;
+    profile.resolved = false;
+    profile.origin = Seconds();
+    return profile;
+}
+
+cl::Event* ProfileDevice(Profile &profile, const std::string &stage, int frame)
+{
+    if (!profile.enabled) return 0;
+
+    ProfileEntry entry;
+    entry.stage = stage;
+    entry.frame = frame;
+    entry.device = true;
+    entry.issued = Seconds() - profile.origin;
+    entry.queued = entry.submit = entry.start = entry.end = 0;
+    profile.entries.push_back(entry);
+    return &profile.entries.back().event;
+}
+
+void ProfileHost(Profile &profile, const std::string &stage, int frame,
+                 double start, double end)
+{
+    if (!profile.enabled) return;
+
+    ProfileEntry entry;
+    entry.stage = stage;
+    entry.frame = frame;
+    entry.device = false;
+    entry.start = start - profile.origin;
+    entry.issued = entry.queued = entry.submit = entry.start;
+    entry.end = end - profile.origin;
+    profile.entries.push_back(entry);
+}
+
+void ProfileCount(Profile &profile, const std::string &name, double value)
+{
+    if (!profile.enabled) return;
+
+    for (size_t t = 0; t < profile.counters.size(); ++t)
+        if (profile.counters[t].name == name)
+        {
+            profile.counters[t].value = value;
+            return;
+        }
+
+    ProfileCounter counter;
+    counter.name = name;
+    counter.value = value;
+    profile.counters.push_back(counter);
+}
+
+/* Reads the counters of every device event, onto the host clock. */
+static void Resolve(Profile &profile)
+{
+    if (profile.resolved) return;
+    profile.resolved = true;
+
+    std::deque<ProfileEntry>::iterator it;
+    double offset = 0;
+    bool any = false;
+
+    for (it = profile.entries.begin(); it != profile.entries.end(); ++it)
+    {
+        if (!it->device) continue;
+
+        cl_ulong t[4] = { 0, 0, 0, 0 };
+        it->event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &t[0]);
+        it->event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &t[1]);
+        it->event.getProfilingInfo(CL_PROFILING_COMMAND_START,  &t[2]);
+        it->event.getProfilingInfo(CL_PROFILING_COMMAND_END,    &t[3]);
+
+        it->queued = t[0] * 1e-9; it->submit = t[1] * 1e-9;
+        it->start  = t[2] * 1e-9; it->end    = t[3] * 1e-9;
+
+        if (!any || (it->queued - it->issued < offset))
+            offset = it->queued - it->issued;
+        any = true;
+    }
+
+    for (it = profile.entries.begin(); it != profile.entries.end(); ++it)
+    {
+        if (!it->device) continue;
+
+        it->queued -= offset; it->submit -= offset;
+        it->start  -= offset; it->end    -= offset;
+    }
+}
+
+static void WriteCSV(std::ostream &out, const std::deque<ProfileEntry> &entries)
+{
+    out << "stage,frame,domain,queued,submit,start,end,duration" << std::endl;
+
+    std::deque<ProfileEntry>::const_iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it)
+    {
+        char line[256];
+        sprintf(line, ",%s,%.9f,%.9f,%.9f,%.9f,%.9f",
+                it->device ? "device" : "host", it->queued, it->submit,
+                it->start, it->end, it->end - it->start);
+
+        out << it->stage << ",";
+        if (it->frame >= 0) out << it->frame;
+        out << line << std::endl;
+    }
+}
+
+static void WriteJSON(std::ostream &out,
+                      const std::deque<ProfileEntry> &entries,
+                      const std::vector<std::string> &stages,
+                      const std::vector<double> &totals,
+                      const std::vector<ProfileCounter> &counters)
+{
+    out << "{" << std::endl << "  \"entries\": [" << std::endl;
+
+    std::deque<ProfileEntry>::const_iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it)
+    {
+        char frame[32] = "null", line[256];
+        if (it->frame >= 0) sprintf(frame, "%d", it->frame);
+        sprintf(line, "\"frame\": %s, \"domain\": \"%s\", \"queued\": %.9f, "
+                "\"submit\": %.9f, \"start\": %.9f, \"end\": %.9f, "
+                "\"duration\": %.9f}", frame, it->device ? "device" : "host",
+                it->queued, it->submit, it->start, it->end,
+                it->end - it->start);
+
+        out << "    {\"stage\": \"" << it->stage << "\", " << line;
+        out << ((it + 1 != entries.end()) ? "," : "") << std::endl;
+    }
+
+    out << "  ]," << std::endl << "  \"totals\": {" << std::endl;
+
+    for (size_t t = 0; t < stages.size(); ++t)
+    {
+        char line[64];
+        sprintf(line, "%.9f", totals[t]);
+        out << "    \"" << stages[t] << "\": " << line;
+        out << ((t + 1 != stages.size()) ? "," : "") << std::endl;
+    }
+
+    out << "  }," << std::endl << "  \"counters\": {" << std::endl;
+
+    for (size_t t = 0; t < counters.size(); ++t)
+    {
+        char line[64];
+        sprintf(line, "%.9g", counters[t].value);
+        out << "    \"" << counters[t].name << "\": " << line;
+        out << ((t + 1 != counters.size()) ? "," : "") << std::endl;
+    }
+
+    out << "  }" << std::endl << "}" << std::endl;
+}
+
+bool WriteProfile(Profile &profile, const std::string &path)
+{
+    if (!profile.enabled) return true;
+    Resolve(profile);
+
+    /* Stages are totalled over all frames, in order of first appearance. */
+    std::vector<std::string> stages;
+    std::vector<double> totals;
+
+    std::deque<ProfileEntry>::const_iterator it;
+    for (it = profile.entries.begin(); it != profile.entries.end(); ++it)
+    {
+        size_t t = 0;
+        while ((t < stages.size()) && (stages[t] != it->stage)) ++t;
+        if (t == stages.size())
+        {
+            stages.push_back(it->stage);
+            totals.push_back(0);
+        }
+
+        totals[t] += it->end - it->start;
+    }
+
+    for (size_t t = 0; t < stages.size(); ++t)
+        std::cout << stages[t] << ": " << totals[t] * 1e3 << "ms" << std::endl;
+    for (size_t t = 0; t < profile.counters.size(); ++t)
+    {
+        const ProfileCounter &counter = profile.counters[t];
+        std::cout << counter.name << ": " << counter.value << std::endl;
+    }
+
+    std::fstream out(path.c_str(), std::ios::out);
+    if (!out) return false;
+
+    bool csv = (path.size() >= 4) && (path.substr(path.size() - 4) == ".csv");
+    if (csv) WriteCSV(out, profile.entries);
+    else WriteJSON(out, profile.entries, stages, totals, profile.counters);
+
+    return out.good();
+}
+
+/* Writes one complete ("X") event, with times in microseconds. */
+static void TraceEvent(std::ostream &out, const std::string &name, int frame,
+                       int pid, int tid, double start, double end)
+{
+    char line[256], args[64] = "{}";
+    if (frame >= 0) sprintf(args, "{\"frame\": %d}", frame);
+    sprintf(line, "\"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": %s}",
+            pid, tid, start * 1e6, (end - start) * 1e6, args);
+
+    out << "," << std::endl << "    {\"name\": \"" << name << "\", " << line;
+}
+
+/* Writes a metadata ("M") event naming a process or thread lane. */
+static void TraceName(std::ostream &out, const char *kind, int pid, int tid,
+                      const char *name)
+{
+    out << "    {\"name\": \"" << kind << "\", \"ph\": \"M\", ";
+    out << "\"pid\": " << pid << ", \"tid\": " << tid << ", ";
+    out << "\"args\": {\"name\": \"" << name << "\"}}";
+}
+
+bool WriteTrace(Profile &profile, const std::string &path)
+{
+    if (!profile.enabled) return true;
+    Resolve(profile);
+
+    std::fstream out(path.c_str(), std::ios::out);
+    if (!out) return false;
+
+    /* The host is process 1 (one thread), the device process 2, with one
+     * lane for the commands being executed and one for those waiting. */
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+    TraceName(out, "process_name", 1, 1, "host");      out << "," << std::endl;
+    TraceName(out, "thread_name",  1, 1, "main");      out << "," << std::endl;
+    TraceName(out, "process_name", 2, 1, "device");    out << "," << std::endl;
+    TraceName(out, "thread_name",  2, 1, "queue");     out << "," << std::endl;
+    TraceName(out, "thread_name",  2, 2, "queued");
+
+    std::deque<ProfileEntry>::const_iterator it;
+    for (it = profile.entries.begin(); it != profile.entries.end(); ++it)
+    {
+        if (!it->device)
+        {
+            TraceEvent(out, it->stage, it->frame, 1, 1, it->start, it->end);
+            continue;
+        }
+
+        TraceEvent(out, it->stage, it->frame, 2, 1, it->start, it->end);
+        TraceEvent(out, it->stage, it->frame, 2, 2, it->queued, it->start);
+    }
+
+    out << std::endl << "]}" << std::endl;
+    return out.good();
+}
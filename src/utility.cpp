@@ -1,4 +1,83 @@
 #include <utility.hpp>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <cmath>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+HostBuffer CreateHostBuffer(cl::Context context, size_t size, bool unified)
+{
+    HostBuffer buffer;
+    buffer.size = size;
+    buffer.unified = unified;
+    cl_mem_flags pinned = CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR;
+
+    if (unified) buffer.buffer = cl::Buffer(context, pinned, size);
+    else
+    {
+        buffer.buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+        buffer.staging = cl::Buffer(context, pinned, size);
+    }
+
+    return buffer;
+}
+
+void* MapHostBuffer(cl::CommandQueue queue, HostBuffer &buffer,
+                    cl_map_flags flags, cl::Event *event)
+{
+    if (buffer.unified)
+        return queue.enqueueMapBuffer(buffer.buffer, CL_TRUE, flags,
+                                      0, buffer.size, 0, event);
+
+    if (flags & CL_MAP_READ)
+        queue.enqueueCopyBuffer(buffer.buffer, buffer.staging,
+                                0, 0, buffer.size, 0, event);
+
+    return queue.enqueueMapBuffer(buffer.staging, CL_TRUE, flags,
+                                  0, buffer.size);
+}
+
+void UnmapHostBuffer(cl::CommandQueue queue, HostBuffer &buffer,
+                     cl_map_flags flags, void *ptr, cl::Event *event)
+{
+    if (buffer.unified)
+    {
+        queue.enqueueUnmapMemObject(buffer.buffer, ptr, 0, event);
+        return;
+    }
+
+    queue.enqueueUnmapMemObject(buffer.staging, ptr);
+
+    if (flags & CL_MAP_WRITE)
+        queue.enqueueCopyBuffer(buffer.staging, buffer.buffer,
+                                0, 0, buffer.size, 0, event);
+}
+
+static void PruneAxis(size_t lo, size_t hi, cl_uint size, cl_uint stages,
+                      bool stockham, cl_uint &offset, cl_uint &bits)
+{
+    bits = 0;
+    while ((bits < stages) && ((size_t)1 << bits) + lo < hi) ++bits;
+    if (stockham && (bits < stages) && ((stages - bits) % 2 == 0)) ++bits;
+    offset = std::min((cl_uint)lo, size - (1 << bits));
+}
+
+CLParams PruneWindow(const Bounds &bounds, const CLParams &dims, bool stockham)
+{
+    CLParams window;
+    PruneAxis(bounds.x0, bounds.x1, dims.dim_x, dims.rad_x, stockham,
+              window.dim_x, window.rad_x);
+    PruneAxis(bounds.y0, bounds.y1, dims.dim_y, dims.rad_y, stockham,
+              window.dim_y, window.rad_y);
+    return window;
+}
 
 uint32_t reverse(uint32_t x, uint32_t radix)
 {
@@ -21,3 +100,80 @@ size_t radix(size_t n)
     while ((n /= 2) != 0) m++;
     return m;
 }
+
+float HalfToFloat(cl_half h)
+{
+    int exponent = (h >> 10) & 0x1f;
+    float mantissa = (float)(h & 0x3ff), value;
+
+    if (exponent == 0x1f) value = (mantissa == 0)
+                        ? std::numeric_limits<float>::infinity()
+                        : std::numeric_limits<float>::quiet_NaN();
+    else if (exponent == 0) value = ldexp(mantissa, -24); /* Subnormal. */
+    else value = ldexp(mantissa + 1024, exponent - 25);
+
+    return (h & 0x8000) ? -value : value;
+}
+
+/* Rounds to nearest (ties away from zero), flushing to zero below the
+ * smallest subnormal and saturating to infinity above the largest half. */
+cl_half FloatToHalf(float f)
+{
+    cl_half sign = (f < 0) ? 0x8000 : 0;
+    f = fabs(f);
+
+    if (f != f) return 0x7e00;
+    if (f >= 65520.0f) return sign | 0x7c00;
+    if (f < ldexp(1.0f, -25)) return sign;
+
+    int exponent;
+    float mantissa = frexp(f, &exponent);   /* f = mantissa 2^exponent. */
+
+    if (exponent < -13)                     /* Subnormal. */
+        return sign | (cl_half)floor(ldexp(f, 24) + 0.5f);
+
+    /* The rounding may carry into the exponent, which is what it should do. */
+    cl_half bits = (cl_half)floor(ldexp(mantissa, 11) + 0.5f) - 1024;
+    return sign | (cl_half)(((exponent + 14) << 10) + bits);
+}
+
+/* Wall clock time in seconds, from an arbitrary origin. */
+double Seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+    struct timeval tv; gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+cl::Program LoadProgram(cl::Context context, std::vector<cl::Device> devices,
+                        std::string options)
+{
+    const char* src = "#include <def.cl>\n"
+                      "#include <fft.cl>\n"
+                      "#include <chirp.cl>\n"
+                      "#include <lens.cl>\n"
+                      "#include <aperture.cl>\n";
+
+    cl::Program::Sources data;
+    data = cl::Program::Sources(1, std::make_pair(src, strlen(src)));
+
+    cl::Program program = cl::Program(context, data, 0);
+
+    char lambda[64];
+    sprintf(lambda, "-D LAMBDA=%.9ef ", LAMBDA);
+    options = "-cl-std=CL1.1 -I cl/ " + std::string(lambda) + options;
+    if (program.build(devices, options.c_str()) != CL_SUCCESS)
+    {
+        std::string log;
+        program.getBuildInfo(devices[0], CL_PROGRAM_BUILD_LOG, &log);
+        std::cout << log << std::endl;
+    }
+
+    return program;
+}